@@ -0,0 +1,93 @@
+#include "arena.hh"
+
+#include <utility>
+
+using namespace std;
+
+namespace bn {
+
+Arena::Arena() : _stats{0, 0, 0, 0}
+{
+}
+
+Arena::~Arena()
+{
+    release();
+}
+
+vector<double>
+Arena::values(unsigned size)
+{
+    lock_guard<mutex> guard(_lock);
+
+    // best fit among the recycled buffers
+    int best = -1;
+    for (unsigned i = 0; i < _free_buffers.size(); ++i) {
+        unsigned capacity = _free_buffers[i].capacity();
+        if (capacity >= size && (best < 0 || capacity < _free_buffers[best].capacity())) {
+            best = i;
+        }
+    }
+
+    vector<double> buffer;
+    if (best >= 0) {
+        buffer = move(_free_buffers[best]);
+        _free_buffers[best] = move(_free_buffers.back());
+        _free_buffers.pop_back();
+        _stats.buffers_reused++;
+    }
+    else {
+        _stats.buffers++;
+        _stats.bytes += size * sizeof(double);
+    }
+    buffer.resize(size);
+    return buffer;
+}
+
+const Factor*
+Arena::factor(Factor &&f)
+{
+    lock_guard<mutex> guard(_lock);
+    _factors.emplace_back(move(f));
+    _owned.insert(&_factors.back());
+    _stats.factors++;
+    return &_factors.back();
+}
+
+void
+Arena::recycle(const Factor *f)
+{
+    // only factors owned by the arena give their storage back
+    lock_guard<mutex> guard(_lock);
+    if (_owned.erase(f) == 0) {
+        return;
+    }
+    Factor *g = const_cast<Factor*>(f);
+    g->_domain.reset();
+    if (g->_values.capacity() > 0) {
+        _free_buffers.push_back(move(g->_values));
+        g->_values.clear();
+    }
+}
+
+void
+Arena::release()
+{
+    _factors.clear();
+    _owned.clear();
+    _free_buffers.clear();
+}
+
+ostream&
+operator<<(ostream &os, const Arena &a)
+{
+    const ArenaStats &stats = a._stats;
+    os << "Arena(";
+    os << "factors:" << stats.factors << ", ";
+    os << "buffers:" << stats.buffers << ", ";
+    os << "buffers reused:" << stats.buffers_reused << ", ";
+    os << "bytes:" << stats.bytes << ")";
+    return os;
+}
+
+}
@@ -0,0 +1,57 @@
+#ifndef _BN_ARENA_H_
+#define _BN_ARENA_H_
+
+#include "domain.hh"
+#include "factor.hh"
+
+#include <ostream>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+#include <mutex>
+
+namespace bn {
+
+struct ArenaStats {
+    unsigned long factors;
+    unsigned long buffers;
+    unsigned long buffers_reused;
+    unsigned long bytes;
+};
+
+// Per-query pool for intermediate factors. Factor objects are stored in
+// blocks, and the value buffers of recycled factors are handed out again
+// to the next factors built in the arena. Everything is released at once
+// when the arena is destroyed. Arenas can be shared by the tasks of a
+// parallel query.
+class Arena {
+public:
+    Arena();
+    Arena(const Arena &a) = delete;
+    ~Arena();
+
+    std::vector<double> values(unsigned size);
+
+    const Factor *factor(Factor &&f);
+
+    // gives back the storage of a factor returned by factor(), other
+    // factors are left untouched
+    void recycle(const Factor *f);
+
+    void release();
+
+    const ArenaStats &stats() const { return _stats; }
+
+    friend std::ostream &operator<<(std::ostream &os, const Arena &a);
+
+private:
+    std::deque<Factor> _factors;
+    std::unordered_set<const Factor*> _owned;   // factors in _factors not yet recycled
+    std::vector<std::vector<double>> _free_buffers;
+    ArenaStats _stats;
+    std::mutex _lock;
+};
+
+}
+
+#endif
@@ -2,6 +2,10 @@
 #include "utils.hh"
 #include "model.hh"
 #include "graph.hh"
+#include "junction_tree.hh"
+#include "join_graph.hh"
+#include "thread_pool.hh"
+#include "kernels.hh"
 using namespace bn;
 
 #include <iostream>
@@ -11,6 +15,8 @@ using namespace bn;
 #include <unordered_map>
 #include <regex>
 #include <cassert>
+#include <cmath>
+#include <chrono>
 using namespace std;
 
 
@@ -20,6 +26,9 @@ static vector<string> positional;
 static BN *model;
 static unordered_map<unsigned,unsigned> evidence;
 
+// calibrated junction tree kept across prompt commands (-jt)
+static JunctionTree *jtree = nullptr;
+
 
 void
 usage(const char *progname);
@@ -42,6 +51,9 @@ execute_marginals();
 void
 execute_query(smatch result);
 
+void
+execute_explain(smatch result);
+
 void
 execute_independence_assertion(smatch result);
 
@@ -57,9 +69,27 @@ execute_markov_blanket(smatch result);
 void
 execute_width();
 
+void
+print_order_cost(const OrderStats &stats);
+
 void
 execute_stats();
 
+void
+execute_observe(smatch result);
+
+void
+execute_retract(smatch result);
+
+void
+execute_clear();
+
+void
+execute_evidence();
+
+JunctionTree *
+resident_tree();
+
 int
 main(int argc, char *argv[])
 {
@@ -105,6 +135,7 @@ main(int argc, char *argv[])
 
 	execute_task();
 
+	delete jtree;
 	delete model;
 
 	return 0;
@@ -124,11 +155,23 @@ usage(const char *progname)
 	cout << "-lw\tcompute partition using (bounded-variance) likelihood weighting" << endl;
 	cout << "-gs\tcompute partition using gibbs sampling" << endl;
 	cout << "-sp\tcompute marginals using sum-product in factor graphs" << endl;
+	cout << "-rbp\tsum-product with residual belief propagation" << endl;
+	cout << "-bp-messages N\tstop residual belief propagation after N message updates" << endl;
+	cout << "-bp-time MS\tstop residual belief propagation after MS milliseconds" << endl;
 	cout << "-ve\tcompute inference using variable elimination" << endl;
 	cout << "-mf\tvariable elimination using min-fill heuristic" << endl;
 	cout << "-wmf\tvariable elimination using weighted min-fill heuristic" << endl;
 	cout << "-md\tvariable elimination using min-degree heuristic" << endl;
 	cout << "-bb\tvariable elimination using bayes-ball" << endl;
+	cout << "-jt\tcompute inference using a junction tree" << endl;
+	cout << "-ijgp\tcompute marginals using iterative join-graph propagation" << endl;
+	cout << "-ibound N\tlimit join-graph clusters to N variables (default 8)" << endl;
+	cout << "-log\tcompute factors and messages in log space" << endl;
+	cout << "-threads N\trun inference on N threads (0 uses all cores)" << endl;
+	cout << "-parallel-min N\tsplit factor operations with at least N entries across threads" << endl;
+	cout << "-order-budget MS\tsearch elimination orderings for MS milliseconds" << endl;
+	cout << "-memory-budget MB\tlimit exact engines chosen by the query planner to MB megabytes" << endl;
+	cout << "-cache-mb MB\tkeep up to MB megabytes of query results (0 disables the cache)" << endl;
 	cout << "-h\tdisplay help information" << endl;
 	cout << "-v\tverbose" << endl;
 }
@@ -145,13 +188,18 @@ read_parameters(int argc, char *argv[])
 	options["gibbs-sampling"] = false;
 
 	options["sum-product"] = false;
+	options["residual-bp"] = false;
 
 	options["variable-elimination"] = false;
 	options["bayes-ball"] = false;
+	options["junction-tree"] = false;
+	options["join-graph"] = false;
 	options["min-fill"] = false;
 	options["weighted-min-fill"] = false;
 	options["min-degree"] = false;
 
+	options["log-space"] = false;
+
 	options["verbose"] = false;
 	options["help"] = false;
 
@@ -177,6 +225,16 @@ read_parameters(int argc, char *argv[])
 		else if (param == "-sp") {
 			options["sum-product"] = true;
 		}
+		else if (param == "-rbp") {
+			options["sum-product"] = true;
+			options["residual-bp"] = true;
+		}
+		else if (param == "-bp-messages" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+"))) {
+			FactorGraph::message_budget = stoul(argv[++i]);
+		}
+		else if (param == "-bp-time" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+(\\.[0-9]*)?"))) {
+			FactorGraph::time_budget = stod(argv[++i]);
+		}
 		else if (param == "-ve") {
 			options["variable-elimination"] = true;
 		}
@@ -192,6 +250,33 @@ read_parameters(int argc, char *argv[])
 		else if (param == "-bb") {
 			options["bayes-ball"] = true;
 		}
+		else if (param == "-jt") {
+			options["junction-tree"] = true;
+		}
+		else if (param == "-ijgp") {
+			options["join-graph"] = true;
+		}
+		else if (param == "-ibound" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+"))) {
+			JoinGraph::ibound = stoul(argv[++i]);
+		}
+		else if (param == "-log") {
+			options["log-space"] = true;
+		}
+		else if (param == "-threads" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+"))) {
+			ThreadPool::set_threads(stoul(argv[++i]));
+		}
+		else if (param == "-parallel-min" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+"))) {
+			Factor::parallel_min_size = stoul(argv[++i]);
+		}
+		else if (param == "-order-budget" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+(\\.[0-9]*)?"))) {
+			Graph::order_budget = stod(argv[++i]);
+		}
+		else if (param == "-memory-budget" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+(\\.[0-9]*)?"))) {
+			BN::memory_budget = stod(argv[++i]) * 1024 * 1024;
+		}
+		else if (param == "-cache-mb" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+(\\.[0-9]*)?"))) {
+			QueryCache::default_capacity = stod(argv[++i]) * 1024 * 1024;
+		}
 		else if (param == "-v") {
 			options["verbose"] = true;
 		}
@@ -229,8 +314,14 @@ execute_partition()
 	if (options["verbose"]) {
 		cout << ">> Computing partition for evidence ..." << endl;
 	}
-	double p = model->partition(evidence, options, uptime);
-	cout << ">> Partition = " << p << endl;
+	if (options["log-space"]) {
+		double lp = model->log_partition(evidence, options, uptime);
+		cout << ">> log10(Partition) = " << lp / log(10.0) << endl;
+	}
+	else {
+		double p = model->partition(evidence, options, uptime);
+		cout << ">> Partition = " << p << endl;
+	}
 	cout << ">> Executed in " << uptime << "ms." << endl << endl;
 }
 
@@ -261,6 +352,7 @@ void
 prompt()
 {
 	regex query_regex("query ([^\\|]+)\\s*(\\|\\s*(.*))?");
+	regex explain_regex("explain ([^\\|]+)\\s*(\\|\\s*(.*))?");
 	regex independence_regex("ind ([0-9]+)\\s*,\\s*([0-9]+)\\s*(\\|\\s*([0-9]+(\\s*,\\s*[0-9]+)*))?");
 
 	regex stats_regex("stats");
@@ -271,6 +363,11 @@ prompt()
 
 	regex width_regex("width");
 
+	regex observe_regex("observe\\s+([0-9]+\\s*=\\s*[0-9]+(\\s*,\\s*[0-9]+\\s*=\\s*[0-9]+)*)");
+	regex retract_regex("retract\\s+([0-9]+(\\s*,\\s*[0-9]+)*)");
+	regex clear_regex("clear");
+	regex evidence_regex("evidence");
+
 	regex help_regex("help");
 	regex quit_regex("quit");
 
@@ -284,6 +381,9 @@ prompt()
 		if (regex_match(line, str_match_result, query_regex)) {
 			execute_query(str_match_result);
 		}
+		else if (regex_match(line, str_match_result, explain_regex)) {
+			execute_explain(str_match_result);
+		}
 		else if (regex_match(line, str_match_result, independence_regex)) {
 			execute_independence_assertion(str_match_result);
 		}
@@ -302,16 +402,33 @@ prompt()
 		else if (regex_match(line, width_regex)) {
 			execute_width();
 		}
+		else if (regex_match(line, str_match_result, observe_regex)) {
+			execute_observe(str_match_result);
+		}
+		else if (regex_match(line, str_match_result, retract_regex)) {
+			execute_retract(str_match_result);
+		}
+		else if (regex_match(line, clear_regex)) {
+			execute_clear();
+		}
+		else if (regex_match(line, evidence_regex)) {
+			execute_evidence();
+		}
 		else if (regex_match(line, help_regex)) {
 			cout << endl;
 			cout << "COMMANDS:" << endl << endl;
 			cout << "query <target> [ | evidence]  to compute a (conditional) distribution" << endl;
+			cout << "explain <target> [ | evidence] to show the engine chosen for a query" << endl;
 			cout << "ind   <target> [ | evidence]  to check an independence assertion" << endl;
 			cout << "stats                         to get summary information about the model" << endl;
 			cout << "roots                         to get the list of root nodes" << endl;
 			cout << "leaves                        to get the list of leaf nodes" << endl;
 			cout << "blanket <var>                 to get the markov blanket of var" << endl;
 			cout << "width                         to get elimination order width for ordering heuristics" << endl;
+			cout << "observe <var>=<value>[, ...]  to set evidence on the junction tree (-jt)" << endl;
+			cout << "retract <var>[, ...]          to retract evidence from the junction tree (-jt)" << endl;
+			cout << "clear                         to retract all evidence (-jt)" << endl;
+			cout << "evidence                      to list the current evidence" << endl;
 			cout << "help                          to display this information" << endl;
 			cout << "quit                          to exit the prompt" << endl;
 			cout << endl;
@@ -343,12 +460,30 @@ execute_query(smatch result)
 	// solve query
 	double uptime;
 	Factor q;
-	if (options["variable-elimination"]) {
+	if (options["junction-tree"]) {
+		JunctionTree *jt = resident_tree();
+		auto start = chrono::steady_clock::now();
+		q = jt->query(target_vars, evidence_vars);
+		auto end = chrono::steady_clock::now();
+		uptime = chrono::duration <double, milli> (end - start).count();
+	}
+	else if (options["variable-elimination"]) {
 		q = model->query_ve(target_vars, evidence_vars, options, uptime);
 	}
-	else {
+	else if (options["bayes-ball"]) {
 		q = model->query(target_vars, evidence_vars, options, uptime);
 	}
+	else {
+		q = model->query_planned(target_vars, evidence_vars, options, uptime);
+	}
+
+	// observed values on the resident tree condition the query as well
+	if (options["junction-tree"] && !jtree->evidence().empty()) {
+		for (auto it : jtree->evidence()) {
+			if (evidence != "") evidence += ",";
+			evidence += to_string(it.first) + "=" + to_string(it.second);
+		}
+	}
 
 	// print results
 	if (evidence != "") {
@@ -358,9 +493,126 @@ execute_query(smatch result)
 		cout << "P(" + target + ") =" << endl;
 	}
 	cout << q;
+	if (options["junction-tree"] && options["verbose"]) {
+		cout << ">> " << *jtree << endl;
+	}
+	cout << ">> Executed in " << uptime << "ms." << endl << endl;
+}
+
+void
+execute_explain(smatch result)
+{
+	regex whitespace_regex("\\s");
+	string target   = result[1]; target   = regex_replace(target,   whitespace_regex, "");
+	string evidence = result[3]; evidence = regex_replace(evidence, whitespace_regex, "");
+
+	unordered_set<const Variable*> target_vars;
+	unordered_set<const Variable*> evidence_vars;
+	parse_vars_set(model, target, target_vars);
+	if (evidence != "") {
+		parse_vars_set(model, evidence, evidence_vars);
+	}
+
+	auto start = chrono::steady_clock::now();
+	QueryPlan plan = model->plan(target_vars, evidence_vars);
+	auto end = chrono::steady_clock::now();
+	double uptime = chrono::duration <double, milli> (end - start).count();
+
+	if (evidence != "") {
+		cout << ">> Plan for P(" + target + "|" + evidence + "):" << endl;
+	}
+	else {
+		cout << ">> Plan for P(" + target + "):" << endl;
+	}
+	cout << plan;
 	cout << ">> Executed in " << uptime << "ms." << endl << endl;
 }
 
+JunctionTree *
+resident_tree()
+{
+	if (!jtree) {
+		vector<const Variable*> vars(model->variables().begin(), model->variables().end());
+		vector<const Factor*> factors(model->factors().begin(), model->factors().end());
+		jtree = new JunctionTree(vars, factors, options);
+		jtree->calibrate(evidence);
+	}
+	return jtree;
+}
+
+void
+execute_observe(smatch result)
+{
+	if (!options["junction-tree"]) {
+		cout << "Error: evidence commands require the junction tree (-jt)." << endl << endl;
+		return;
+	}
+
+	regex whitespace_regex("\\s");
+	string assignments = result[1]; assignments = regex_replace(assignments, whitespace_regex, "");
+
+	unordered_map<unsigned,unsigned> observed;
+	if (parse_evidence(model, assignments, observed)) {
+		cout << "Error: not a valid evidence." << endl << endl;
+		return;
+	}
+
+	JunctionTree *jt = resident_tree();
+	for (auto it : observed) {
+		evidence[it.first] = it.second;
+		jt->observe(it.first, it.second);
+	}
+	cout << endl;
+}
+
+void
+execute_retract(smatch result)
+{
+	if (!options["junction-tree"]) {
+		cout << "Error: evidence commands require the junction tree (-jt)." << endl << endl;
+		return;
+	}
+
+	regex whitespace_regex("\\s");
+	string vars = result[1]; vars = regex_replace(vars, whitespace_regex, "");
+
+	unordered_set<const Variable*> retracted;
+	parse_vars_set(model, vars, retracted);
+
+	JunctionTree *jt = resident_tree();
+	for (auto pv : retracted) {
+		evidence.erase(pv->id());
+		jt->retract(pv->id());
+	}
+	cout << endl;
+}
+
+void
+execute_clear()
+{
+	if (!options["junction-tree"]) {
+		cout << "Error: evidence commands require the junction tree (-jt)." << endl << endl;
+		return;
+	}
+
+	JunctionTree *jt = resident_tree();
+	for (auto it : evidence) {
+		jt->retract(it.first);
+	}
+	evidence.clear();
+	cout << endl;
+}
+
+void
+execute_evidence()
+{
+	cout << ">> Evidence:" << endl;
+	for (auto it : evidence) {
+		cout << "Variable = " << it.first << ", Value = " << it.second << endl;
+	}
+	cout << endl;
+}
+
 void
 execute_independence_assertion(smatch result)
 {
@@ -415,6 +667,14 @@ execute_markov_blanket(smatch result)
 	cout << endl << endl;
 }
 
+void
+print_order_cost(const OrderStats &stats)
+{
+	cout << "   max clique = " << stats.max_clique;
+	cout << ", memory = " << stats.bytes << " bytes";
+	cout << ", madds = " << stats.madds << endl;
+}
+
 void
 execute_width()
 {
@@ -427,7 +687,12 @@ execute_width()
 	// original order
 	original_width = g.order_width(vars);
 	cout << endl;
+	vector<unsigned> ids;
+	for (auto const pv : vars) {
+		ids.push_back(pv->id());
+	}
 	cout << ">> Original elimination order          (width = " << original_width << ")" << endl;
+	print_order_cost(g.order_stats(ids));
 	if (options["verbose"]) {
 		cout << "  ";
 		for (auto const pv : vars) {
@@ -440,8 +705,9 @@ execute_width()
 	unordered_map<string,bool> order_options;
 	order_options["min-degree"] = true;
 
-	vector<unsigned> ids = g.ordering(vars, min_degree, order_options);
+	ids = g.ordering(vars, min_degree, order_options);
 	cout << ">> Min-degree elimination order        (width = " << min_degree << ")" << endl;
+	print_order_cost(g.order_stats(ids));
 	if (options["verbose"]) {
 		cout << "  ";
 		for (auto id : ids) {
@@ -456,6 +722,7 @@ execute_width()
 
 	ids = g.ordering(vars, min_fill_width, order_options);
 	cout << ">> Min-fill elimination order          (width = " << min_fill_width << ")" << endl;
+	print_order_cost(g.order_stats(ids));
 	if (options["verbose"]) {
 		cout << "  ";
 		for (auto id : ids) {
@@ -470,6 +737,7 @@ execute_width()
 
 	ids = g.ordering(vars, weighted_min_fill_width, order_options);
 	cout << ">> Weighted min-fill elimination order (width = " << weighted_min_fill_width << ")" << endl;
+	print_order_cost(g.order_stats(ids));
 	if (options["verbose"]) {
 		cout << "  ";
 		for (auto id : ids) {
@@ -477,6 +745,21 @@ execute_width()
 		}
 		cout << endl;
 	}
+
+	// anytime search from the best greedy order (-order-budget)
+	if (Graph::order_budget > 0) {
+		unsigned anytime_width;
+		ids = g.anytime_ordering(vars, anytime_width, order_options);
+		cout << ">> Anytime elimination order           (width = " << anytime_width << ")" << endl;
+		print_order_cost(g.order_stats(ids));
+		if (options["verbose"]) {
+			cout << "  ";
+			for (auto id : ids) {
+				cout << " " << id;
+			}
+			cout << endl;
+		}
+	}
 	cout << endl;
 }
 
@@ -545,5 +828,12 @@ execute_stats()
 	cout << ">> number of parameters = " << nparams << endl;
 	cout << ">> lowest probability = " << minprob << ", highest probability = " << maxprob << endl;
 	cout << ">> max partition = " << maxpartition << endl;
+	cout << ">> kernels = " << kernels::isa() << ", interned domains = " << Domain::interned() << endl;
+	cout << ">> ordering cache: entries = " << OrderingCache::instance().size() << ", hits = " << OrderingCache::instance().hits() << ", misses = " << OrderingCache::instance().misses() << endl;
+	QueryCacheStats results = model->results().stats();
+	unsigned long lookups = results.hits + results.misses;
+	cout << ">> result cache: entries = " << results.entries << ", bytes = " << results.bytes << "/" << model->results().capacity();
+	cout << ", hits = " << results.hits << ", misses = " << results.misses;
+	cout << ", hit rate = " << (lookups ? 1.0 * results.hits / lookups : 0.0) << ", evictions = " << results.evictions << endl;
 	cout << endl;
 }
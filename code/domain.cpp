@@ -1,94 +1,205 @@
 #include "domain.hh"
 
 #include <iostream>
+#include <algorithm>
+#include <climits>
+#include <functional>
+#include <mutex>
 
 using namespace std;
 
 namespace bn {
 
-Domain::Domain()
+Domain::Domain() : _width(0), _size(1)
 {
-    _width = 0;
-    _size = 1;
 }
 
-Domain::Domain(vector<const Variable*> scope) : _scope(scope), _width(scope.size())
+Domain::Domain(const vector<const Variable*> &scope) : _width(scope.size())
 {
-    _size = 1;
-    if (_width > 0) {
-        _offset.reserve(_width);
-        for (int i = _width-1; i >= 0; --i) {
-            _offset[i] = _size;
-            _size *= _scope[i]->size();
-            _var_to_index[_scope[i]->id()] = i;
-        }
-    }
+    _scope.resize(_width);
+    copy(scope.begin(), scope.end(), _scope.begin());
+    update_offsets();
+    update_keys();
 }
 
-Domain::Domain(const Domain &d) : Domain(d._scope)
+Domain::Domain(const Domain &d1, const Domain &d2) : _scope(d1._scope)
 {
-}
+    // merge sorted keys to find the variables of d2 not in d1
+    SmallVector<unsigned, INLINE_WIDTH> position;
+    position.resize(d2._width);
+    fill(position.begin(), position.end(), UINT_MAX);
 
-Domain::Domain(const Domain &d1, const Domain &d2)
-{
-    _scope = d1._scope;
-    unsigned width2 = d2._width;
-    for (unsigned i = 0; i < width2; ++i) {
-        const Variable *v = d2[i];
-        if (!d1.in_scope(v)) {
-            _scope.push_back(v);
+    unsigned i = 0;
+    for (unsigned j = 0; j < d2._width; ++j) {
+        unsigned id = d2._keys[j].id;
+        while (i < d1._width && d1._keys[i].id < id) ++i;
+        if (i == d1._width || d1._keys[i].id != id) {
+            position[d2._keys[j].index] = 0;
+        }
+    }
+
+    // append them in d2 scope order
+    for (unsigned j = 0; j < d2._width; ++j) {
+        if (position[j] == 0) {
+            position[j] = _scope.size();
+            _scope.push_back(d2._scope[j]);
         }
     }
     _width = _scope.size();
-    _size = 1;
-    if (_width > 0) {
-        _offset.reserve(_width);
-        for (int i = _width-1; i >= 0; --i) {
-            _offset[i] = _size;
-            _size *= _scope[i]->size();
-            _var_to_index[_scope[i]->id()] = i;
+    update_offsets();
+
+    // merge d1 keys with the keys of the appended variables
+    _keys.resize(_width);
+    unsigned k = 0;
+    i = 0;
+    for (unsigned j = 0; j < d2._width; ++j) {
+        const Key &key = d2._keys[j];
+        if (position[key.index] == UINT_MAX) continue;
+        while (i < d1._width && d1._keys[i].id < key.id) {
+            _keys[k++] = d1._keys[i++];
         }
+        _keys[k++] = Key{ key.id, position[key.index] };
+    }
+    while (i < d1._width) {
+        _keys[k++] = d1._keys[i++];
     }
 }
 
 Domain::Domain(const Domain &d, const Variable *v)
 {
+    int removed = d.index(v->id());
     for (unsigned i = 0; i < d._width; ++i) {
-        if (d._scope[i] != v) {
+        if ((int) i != removed) {
             _scope.push_back(d._scope[i]);
         }
     }
     _width = _scope.size();
-    _size = 1;
-    if (_width > 0) {
-        _offset.reserve(_width);
-        for (int i = _width-1; i >= 0; --i) {
-            const Variable *var = _scope[i];
-            _offset[i] = _size;
-            _size *= var->size();
-            _var_to_index[var->id()] = i;
-        }
+    update_offsets();
+
+    for (auto key : d._keys) {
+        if ((int) key.index == removed) continue;
+        if (removed >= 0 && (int) key.index > removed) key.index--;
+        _keys.push_back(key);
     }
 }
 
 Domain::Domain(const Domain &d, const unordered_map<unsigned,unsigned> &evidence)
 {
-    for (auto it_scope : d._scope) {
-        const Variable *variable = it_scope;
+    SmallVector<unsigned, INLINE_WIDTH> position;
+    position.resize(d._width);
+    for (unsigned i = 0; i < d._width; ++i) {
+        const Variable *variable = d._scope[i];
         if (!evidence.count(variable->id())) {
+            position[i] = _scope.size();
             _scope.push_back(variable);
         }
+        else {
+            position[i] = UINT_MAX;
+        }
     }
     _width = _scope.size();
+    update_offsets();
+
+    for (auto key : d._keys) {
+        if (position[key.index] == UINT_MAX) continue;
+        _keys.push_back(Key{ key.id, position[key.index] });
+    }
+}
+
+// Interning table of immutable domains keyed by their ordered scope.
+// Entries are removed by the deleter of the last shared handle, under the
+// table lock, before the domain itself is deleted. Scopes are hashed by
+// variable address so that releasing a domain never reads its variables,
+// which may already be gone.
+struct ScopeHash {
+    size_t operator()(const Domain *d) const {
+        size_t h = d->width();
+        for (unsigned i = 0; i < d->width(); ++i) {
+            h = h * 31 + hash<const Variable*>()((*d)[i]);
+        }
+        return h;
+    }
+};
+
+struct ScopeEqual {
+    bool operator()(const Domain *d1, const Domain *d2) const {
+        if (d1->width() != d2->width()) return false;
+        for (unsigned i = 0; i < d1->width(); ++i) {
+            if ((*d1)[i] != (*d2)[i]) return false;
+        }
+        return true;
+    }
+};
+
+struct DomainTable {
+    mutex lock;
+    unordered_map<const Domain*, weak_ptr<const Domain>, ScopeHash, ScopeEqual> domains;
+};
+
+static DomainTable&
+domain_table()
+{
+    static DomainTable *table = new DomainTable();  // never destroyed
+    return *table;
+}
+
+shared_ptr<const Domain>
+Domain::intern(const Domain &d)
+{
+    DomainTable &table = domain_table();
+    lock_guard<mutex> guard(table.lock);
+
+    auto it = table.domains.find(&d);
+    if (it != table.domains.end()) {
+        shared_ptr<const Domain> shared = it->second.lock();
+        if (shared) return shared;
+        table.domains.erase(it);  // last handle is being released
+    }
+
+    shared_ptr<const Domain> shared(new Domain(d), [](const Domain *pd) {
+        DomainTable &table = domain_table();
+        {
+            lock_guard<mutex> guard(table.lock);
+            auto it = table.domains.find(pd);
+            if (it != table.domains.end() && it->first == pd) {
+                table.domains.erase(it);
+            }
+        }
+        delete pd;
+    });
+    table.domains[shared.get()] = shared;
+    return shared;
+}
+
+unsigned
+Domain::interned()
+{
+    DomainTable &table = domain_table();
+    lock_guard<mutex> guard(table.lock);
+    return table.domains.size();
+}
+
+void
+Domain::update_offsets()
+{
     _size = 1;
-    _offset.reserve(_width);
+    _offset.resize(_width);
     for (int i = _width-1; i >= 0; --i) {
         _offset[i] = _size;
         _size *= _scope[i]->size();
-        _var_to_index[_scope[i]->id()] = i;
     }
 }
 
+void
+Domain::update_keys()
+{
+    _keys.resize(_width);
+    for (unsigned i = 0; i < _width; ++i) {
+        _keys[i] = Key{ _scope[i]->id(), i };
+    }
+    sort(_keys.begin(), _keys.end(), [](const Key &k1, const Key &k2) { return k1.id < k2.id; });
+}
+
 const Variable*
 Domain::operator[](unsigned i) const
 {
@@ -96,18 +207,32 @@ Domain::operator[](unsigned i) const
     else throw "Domain::operator[unsigned i]: Index out of range!";
 }
 
+int
+Domain::index(unsigned id) const
+{
+    const Key *it = lower_bound(_keys.begin(), _keys.end(), id, [](const Key &k, unsigned id) { return k.id < id; });
+    if (it != _keys.end() && it->id == id) return it->index;
+    return -1;
+}
+
 bool
 Domain::in_scope(const Variable* v) const
 {
-    unordered_map<unsigned,unsigned>::const_iterator it = _var_to_index.find(v->id());
-    return (it != _var_to_index.end());
+    return index(v->id()) >= 0;
 }
 
 bool
 Domain::in_scope(unsigned id) const
 {
-    unordered_map<unsigned,unsigned>::const_iterator it = _var_to_index.find(id);
-    return (it != _var_to_index.end());
+    return index(id) >= 0;
+}
+
+unsigned
+Domain::stride(const Variable *v) const
+{
+    int i = index(v->id());
+    if (i < 0) return 0;
+    return _offset[i];
 }
 
 void
@@ -137,20 +262,16 @@ Domain::next_valuation_with_evidence(vector<unsigned> &valuation, const unordere
 
 void
 Domain::update_valuation_with_evidence(vector<unsigned> &valuation, const unordered_map<unsigned,unsigned> &evidence) const {
-    if (_width == 0) return;
-    for (auto it_evidence : evidence) {
-        unsigned id = it_evidence.first;
-        unsigned value = it_evidence.second;
-
-        unordered_map<unsigned,unsigned>::const_iterator it_index = _var_to_index.find(id);
-        if (it_index != _var_to_index.end()) {
-            valuation[it_index->second] = value;
+    for (unsigned i = 0; i < _width; ++i) {
+        unordered_map<unsigned,unsigned>::const_iterator it_evidence = evidence.find(_scope[i]->id());
+        if (it_evidence != evidence.end()) {
+            valuation[i] = it_evidence->second;
         }
     }
 }
 
 unsigned
-Domain::position_valuation(vector<unsigned> valuation) const
+Domain::position_valuation(const vector<unsigned> &valuation) const
 {
     unsigned pos = 0;
     for (int i = _width-1; i >= 0; --i) {
@@ -160,33 +281,76 @@ Domain::position_valuation(vector<unsigned> valuation) const
 }
 
 unsigned
-Domain::position_consistent_valuation(vector<unsigned> valuation, const Domain &domain) const
+Domain::position_consistent_valuation(const vector<unsigned> &valuation, const Domain &domain) const
 {
-    if (_width == 0) { return 0; }
-    else {
-        unsigned pos = 0;
-        unsigned index = 0;
-        for (auto v : _scope) {
-            unordered_map<unsigned,unsigned>::const_iterator it_index = _var_to_index.find(v->id());
-            unordered_map<unsigned,unsigned>::const_iterator it_index2 = domain._var_to_index.find(v->id());
-            if (it_index != _var_to_index.end() && it_index2 != _var_to_index.end()) {
-                pos +=  _offset[it_index->second] * valuation[it_index2->second];
-            }
-            index++;
+    unsigned pos = 0;
+    for (unsigned i = 0; i < _width; ++i) {
+        int j = domain.index(_scope[i]->id());
+        if (j >= 0) {
+            pos += _offset[i] * valuation[j];
         }
-        return pos;
     }
+    return pos;
 }
 
 unsigned
-Domain::position_consistent_valuation(vector<unsigned> valuation, const Domain &domain, const Variable *v, unsigned value) const
+Domain::position_consistent_valuation(const vector<unsigned> &valuation, const Domain &domain, const Variable *v, unsigned value) const
 {
-    unsigned pos = position_consistent_valuation(valuation, domain);
-    unordered_map<unsigned,unsigned>::const_iterator it_index = _var_to_index.find(v->id());
-    if (it_index != _var_to_index.end()) {
-        pos += _offset[it_index->second] * value;
+    return position_consistent_valuation(valuation, domain) + stride(v) * value;
+}
+
+DomainIterator::DomainIterator(const Domain &domain, const vector<const Domain*> &domains) :
+    _width(domain.width()),
+    _ndomains(domains.size()),
+    _cardinality(_width),
+    _valuation(_width, 0),
+    _stride(_width * _ndomains),
+    _rollback(_width * _ndomains),
+    _positions(_ndomains, 0)
+{
+    for (unsigned i = 0; i < _width; ++i) {
+        const Variable *v = domain[i];
+        _cardinality[i] = v->size();
+        for (unsigned k = 0; k < _ndomains; ++k) {
+            unsigned s = domains[k]->stride(v);
+            _stride[i*_ndomains + k] = s;
+            _rollback[i*_ndomains + k] = (v->size() - 1) * s;
+        }
+    }
+}
+
+void
+DomainIterator::next()
+{
+    for (int i = _width-1; i >= 0; --i) {
+        const unsigned *stride = &_stride[i*_ndomains];
+        if (++_valuation[i] < _cardinality[i]) {
+            for (unsigned k = 0; k < _ndomains; ++k) {
+                _positions[k] += stride[k];
+            }
+            return;
+        }
+        const unsigned *rollback = &_rollback[i*_ndomains];
+        for (unsigned k = 0; k < _ndomains; ++k) {
+            _positions[k] -= rollback[k];
+        }
+        _valuation[i] = 0;
+    }
+}
+
+void
+DomainIterator::seek(unsigned index)
+{
+    fill(_positions.begin(), _positions.end(), 0);
+    for (int i = _width-1; i >= 0; --i) {
+        unsigned value = index % _cardinality[i];
+        index /= _cardinality[i];
+        _valuation[i] = value;
+        const unsigned *stride = &_stride[i*_ndomains];
+        for (unsigned k = 0; k < _ndomains; ++k) {
+            _positions[k] += value * stride[k];
+        }
     }
-    return pos;
 }
 
 ostream&
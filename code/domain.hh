@@ -2,22 +2,29 @@
 #define _BN_DOMAIN_H_
 
 #include "variable.hh"
+#include "small_vector.hh"
 
 #include <vector>
 #include <unordered_map>
+#include <memory>
 
 namespace bn {
 
 class Domain {
 public:
     Domain();
-    Domain(std::vector<const Variable*> scope);
-    Domain(const Domain &d);
+    Domain(const std::vector<const Variable*> &scope);
+    Domain(const Domain &d) = default;
     Domain(const Domain &d1, const Domain &d2);
     Domain(const Domain &d, const Variable *v);
     Domain(const Domain &d, const std::unordered_map<unsigned,unsigned> &evidence);
 
-    std::vector<const Variable*> scope() const { return _scope; };
+    Domain &operator=(const Domain &d) = default;
+
+    static std::shared_ptr<const Domain> intern(const Domain &d);
+    static unsigned interned();
+
+    std::vector<const Variable*> scope() const { return std::vector<const Variable*>(_scope.begin(), _scope.end()); };
     unsigned width() const { return _width; };
     unsigned size()  const { return _size;  };
 
@@ -26,22 +33,61 @@ public:
     bool in_scope(const Variable* v) const;
     bool in_scope(unsigned id) const;
 
+    int index(unsigned id) const;
+    unsigned stride(const Variable *v) const;
+
     void next_valuation(std::vector<unsigned> &valuation) const;
     void next_valuation_with_evidence(std::vector<unsigned> &valuation, const std::unordered_map<unsigned,unsigned> &evidence) const;
     void update_valuation_with_evidence(std::vector<unsigned> &valuation, const std::unordered_map<unsigned,unsigned> &evidence) const;
 
-    unsigned position_valuation(std::vector<unsigned> valuation) const;
-    unsigned position_consistent_valuation(std::vector<unsigned> valuation, const Domain &domain) const;
-    unsigned position_consistent_valuation(std::vector<unsigned> valuation, const Domain &domain, const Variable *v, unsigned value) const;
+    unsigned position_valuation(const std::vector<unsigned> &valuation) const;
+    unsigned position_consistent_valuation(const std::vector<unsigned> &valuation, const Domain &domain) const;
+    unsigned position_consistent_valuation(const std::vector<unsigned> &valuation, const Domain &domain, const Variable *v, unsigned value) const;
 
     friend std::ostream &operator<<(std::ostream &o, const Domain &v);
 
 private:
-    std::vector<const Variable*> _scope;
+    // variable id and its index in the scope, kept sorted by id
+    struct Key {
+        unsigned id;
+        unsigned index;
+    };
+
+    static const unsigned INLINE_WIDTH = 8;
+
+    SmallVector<const Variable*, INLINE_WIDTH> _scope;
     unsigned _width;
     unsigned _size;
-    std::vector<unsigned> _offset;
-    std::unordered_map<unsigned, unsigned> _var_to_index;
+    SmallVector<unsigned, INLINE_WIDTH> _offset;
+    SmallVector<Key, INLINE_WIDTH> _keys;
+
+    void update_offsets();
+    void update_keys();
+};
+
+// Odometer over the valuations of a domain that keeps, for each one of a set
+// of consistent domains, the linear position of the current valuation.
+// Strides are precomputed so that next() only does integer additions.
+class DomainIterator {
+public:
+    DomainIterator(const Domain &domain, const std::vector<const Domain*> &domains);
+
+    unsigned position(unsigned k) const { return _positions[k]; }
+    const std::vector<unsigned> &valuation() const { return _valuation; }
+
+    void next();
+
+    // jump to the valuation at linear position index of the domain
+    void seek(unsigned index);
+
+private:
+    unsigned _width;
+    unsigned _ndomains;
+    std::vector<unsigned> _cardinality;
+    std::vector<unsigned> _valuation;
+    std::vector<unsigned> _stride;    // _stride[i*_ndomains + k] = offset of i-th variable in k-th domain
+    std::vector<unsigned> _rollback;  // _rollback[i*_ndomains + k] = (card_i - 1) * _stride[i*_ndomains + k]
+    std::vector<unsigned> _positions;
 };
 
 }
@@ -1,54 +1,119 @@
 #include "factor.hh"
+#include "kernels.hh"
+#include "arena.hh"
+#include "thread_pool.hh"
 
 #include <iostream>
+#include <algorithm>
 #include <iomanip>
 #include <cassert>
 #include <cmath>
 #include <random>
+#include <utility>
 using namespace std;
 
 namespace bn {
 
-Factor::Factor(const Domain *domain, vector<double> values, double partition) : _values(values)
+const double Factor::SPARSE_DENSITY = 0.25;
+const unsigned Factor::SPARSE_MIN_SIZE = 64;
+
+unsigned Factor::parallel_min_size = 1 << 20;
+
+// Number of chunks to split an output with the given number of entries,
+// 1 for outputs below the threshold so they stay on the calling thread.
+static unsigned
+chunks(unsigned entries)
+{
+    unsigned threads = ThreadPool::instance().threads();
+    if (entries < Factor::parallel_min_size || threads == 1) {
+        return 1;
+    }
+    return 4 * threads;
+}
+
+// Run body(begin, end) over nchunks chunks of the range [0, size) and
+// return the partial partition of each chunk.
+template <typename Body>
+static vector<double>
+chunked(unsigned size, unsigned nchunks, Body body)
+{
+    nchunks = max(1u, min(nchunks, size));
+    if (nchunks == 1) {
+        return vector<double>(1, body(0, size));
+    }
+
+    unsigned length = (size + nchunks - 1) / nchunks;
+    vector<double> partial(nchunks, 0.0);
+    TaskGroup group;
+    for (unsigned c = 0; c < nchunks; ++c) {
+        unsigned begin = min(size, c * length);
+        unsigned end = min(size, begin + length);
+        group.run([&partial, &body, c, begin, end]() { partial[c] = body(begin, end); });
+    }
+    group.wait();
+    return partial;
+}
+
+static double
+reduce_partition(const vector<double> &partial, bool log_space)
+{
+    if (log_space) {
+        return kernels::logsumexp(partial.data(), partial.size());
+    }
+    return kernels::sum(partial.data(), partial.size());
+}
+
+Factor::Factor(shared_ptr<const Domain> domain, vector<double> values, double partition) :
+    _domain(move(domain)),
+    _values(move(values)),
+    _partition(partition),
+    _log(false),
+    _sparse(false)
 {
-    _domain = domain;
-    _partition = partition;
 }
 
-Factor::Factor(const Domain *domain, double value) :
-    _domain(domain),
-    _values(vector<double>(domain->size(), value)),
-    _partition(domain->size() * value)
+Factor::Factor(shared_ptr<const Domain> domain, double value) :
+    _domain(move(domain)),
+    _values(vector<double>(_domain->size(), value)),
+    _partition(_domain->size() * value),
+    _log(false),
+    _sparse(false)
 {
 }
 
 Factor::Factor(double value) :
-    _domain(new Domain()),
+    _domain(Domain::intern(Domain())),
     _values(vector<double>(1, value)),
-    _partition(value)
+    _partition(value),
+    _log(false),
+    _sparse(false)
 {
 }
 
 Factor::Factor(const Factor &f) :
-    _domain(new Domain(*f._domain)),
+    _domain(f._domain),
     _values(f._values),
-    _partition(f._partition)
+    _partition(f._partition),
+    _log(f._log),
+    _sparse(f._sparse),
+    _index(f._index)
 {
 }
 
 Factor::Factor(Factor &&f)
 {
-    _domain = f._domain;
-    _values = f._values;
+    _domain = move(f._domain);
+    _values = move(f._values);
     _partition = f._partition;
-    f._domain = nullptr;
+    _log = f._log;
+    _sparse = f._sparse;
+    _index = move(f._index);
     f._values.clear();
     f._partition = 0.0;
 }
 
 Factor::~Factor()
 {
-	delete _domain;
 }
 
 
@@ -56,12 +121,13 @@ Factor&
 Factor::operator=(Factor &&f)
 {
     if (this != &f) {
-        delete _domain;
         _values.clear();
-        _domain = f._domain;
-        _values = f._values;
+        _domain = move(f._domain);
+        _values = move(f._values);
         _partition = f._partition;
-        f._domain = nullptr;
+        _log = f._log;
+        _sparse = f._sparse;
+        _index = move(f._index);
         f._values.clear();
         f._partition = 0.0;
     }
@@ -83,99 +149,202 @@ Factor::operator*=(const Factor &f)
 const double&
 Factor::operator[](unsigned i) const
 {
-    if (i < size()) return _values.at(i);
-    else throw "Factor::operator[]: Index out of range.";
+    static const double zero = 0.0;
+    if (i >= size()) throw "Factor::operator[]: Index out of range.";
+    if (_sparse) {
+        auto it = lower_bound(_index.begin(), _index.end(), i);
+        if (it == _index.end() || *it != i) return zero;
+        return _values[it - _index.begin()];
+    }
+    return _values.at(i);
 }
 
 double&
 Factor::operator[](unsigned i)
 {
-    if (i < size()) return _values[i];
-    else throw "Factor::operator[]: Index out of range.";
+    if (i >= size()) throw "Factor::operator[]: Index out of range.";
+
+    // writes go to a dense copy of sparse factors
+    if (_sparse) {
+        *this = to_dense();
+    }
+    return _values[i];
 }
 
 double
 Factor::max() const
 {
-    double m = 0.0;
-    for (auto p : _values) {
-        if (p > m) m = p;
-    }
-    return m;
+    if (_values.empty()) return 0.0;
+    double m = kernels::max(_values.data(), _values.size());
+    if (_log) m = std::exp(m);
+    return (m > 0.0) ? m : 0.0;
 }
 
 double
 Factor::min() const
 {
-    double m = _partition;
-    for (auto p : _values) {
-        if (p < m) m = p;
+    if (_sparse && _values.size() < size()) return 0.0;
+    double m = kernels::min(_values.data(), _values.size());
+    if (_log) {
+        m = std::exp(m);
+        double partition = std::exp(_partition);
+        return (m < partition) ? m : partition;
     }
-    return m;
+    return (m < _partition) ? m : _partition;
 }
 
 Factor
 Factor::product(const Factor &f) const
 {
-    const Domain *d1 = this->_domain;
-    const Domain *d2 = f._domain;
+    // mixed operands are combined in log space
+    if (_log != f._log) {
+        return _log ? product(f.log()) : log().product(f);
+    }
 
-    Domain *new_domain = new Domain(*d1, *d2);
-    unsigned width = new_domain->width();
-    unsigned size = new_domain->size();
+    // drive the product from the sparse operand with fewer entries
+    if (_sparse || f._sparse) {
+        auto multiply = [](double a, double b) { return a * b; };
+        if (!f._sparse || (_sparse && _values.size() <= f._values.size())) {
+            return sparse_combine(f, multiply);
+        }
+        return f.sparse_combine(*this, multiply);
+    }
 
-    vector<unsigned> valuation(width, 0);
+    const double *values1 = _values.data();
+    const double *values2 = f._values.data();
+
+    // interned domains: same scope implies same layout
+    if (_domain == f._domain) {
+        unsigned size = _domain->size();
+        vector<double> values(size);
+        vector<double> partial = chunked(size, chunks(size), [&](unsigned begin, unsigned end) -> double {
+            if (_log) {
+                for (unsigned i = begin; i < end; ++i) {
+                    values[i] = values1[i] + values2[i];
+                }
+                return kernels::logsumexp(values.data() + begin, end - begin);
+            }
+            double partition = 0;
+            for (unsigned i = begin; i < end; ++i) {
+                double value = values1[i] * values2[i];
+                values[i] = value;
+                partition += value;
+            }
+            return partition;
+        });
+        Factor new_factor(_domain, move(values), reduce_partition(partial, _log));
+        new_factor._log = _log;
+        return new_factor;
+    }
 
-    double partition = 0;
-    vector<double> values;
-    for (unsigned i = 0; i < size; ++i) {
-        // find position in linearization of consistent valuation
-        unsigned pos1 = d1->position_consistent_valuation(valuation, *new_domain);
-        unsigned pos2 = d2->position_consistent_valuation(valuation, *new_domain);
+    const Domain *d1 = _domain.get();
+    const Domain *d2 = f._domain.get();
 
-        // set product factor value
-        double value = (*this)[pos1] * f[pos2];
-        values.push_back(value);
-        partition += value;
+    shared_ptr<const Domain> new_domain = Domain::intern(Domain(*d1, *d2));
+    unsigned size = new_domain->size();
 
-        // find next valuation
-        new_domain->next_valuation(valuation);
-    }
+    vector<double> values(size);
+    vector<double> partial = chunked(size, chunks(size), [&](unsigned begin, unsigned end) -> double {
+        DomainIterator it(*new_domain, { d1, d2 });
+        it.seek(begin);
+        if (_log) {
+            for (unsigned i = begin; i < end; ++i) {
+                values[i] = values1[it.position(0)] + values2[it.position(1)];
+                it.next();
+            }
+            return kernels::logsumexp(values.data() + begin, end - begin);
+        }
+        double partition = 0;
+        for (unsigned i = begin; i < end; ++i) {
+            // set product factor value from positions of consistent valuations
+            double value = values1[it.position(0)] * values2[it.position(1)];
+            values[i] = value;
+            partition += value;
+
+            // find next valuation
+            it.next();
+        }
+        return partition;
+    });
 
-    Factor new_factor(new_domain, values, partition);
+    Factor new_factor(new_domain, move(values), reduce_partition(partial, _log));
+    new_factor._log = _log;
     return new_factor;
 }
 
 Factor
 Factor::divide(const Factor &f) const
 {
-    const Domain *d1 = this->_domain;
-    const Domain *d2 = f._domain;
+    if (_log != f._log) {
+        return _log ? divide(f.log()) : log().divide(f);
+    }
 
-    Domain *new_domain = new Domain(*d1, *d2);
-    unsigned width = new_domain->width();
-    unsigned size = new_domain->size();
+    if (_sparse) {
+        return sparse_combine(f, [](double a, double b) { assert(b != 0); return a / b; });
+    }
+    if (f._sparse) {
+        return divide(f.to_dense());
+    }
 
-    vector<unsigned> valuation(width, 0);
+    const double *values1 = _values.data();
+    const double *values2 = f._values.data();
 
-    double partition = 0;
-    vector<double> values;
-    for (unsigned i = 0; i < size; ++i) {
-        // find position in linearization of consistent valuation
-        unsigned pos1 = d1->position_consistent_valuation(valuation, *new_domain);
-        unsigned pos2 = d2->position_consistent_valuation(valuation, *new_domain);
+    // interned domains: same scope implies same layout
+    if (_domain == f._domain) {
+        unsigned size = _domain->size();
+        double partition = 0;
+        vector<double> values(size);
+        if (_log) {
+            for (unsigned i = 0; i < size; ++i) {
+                values[i] = values1[i] - values2[i];
+            }
+            partition = kernels::logsumexp(values.data(), size);
+        }
+        else {
+            for (unsigned i = 0; i < size; ++i) {
+                assert(values2[i] != 0);
+                double value = values1[i] / values2[i];
+                values[i] = value;
+                partition += value;
+            }
+        }
+        Factor new_factor(_domain, move(values), partition);
+        new_factor._log = _log;
+        return new_factor;
+    }
+
+    const Domain *d1 = _domain.get();
+    const Domain *d2 = f._domain.get();
+
+    shared_ptr<const Domain> new_domain = Domain::intern(Domain(*d1, *d2));
+    unsigned size = new_domain->size();
 
-        // set product factor value
-        assert(f[pos2] != 0);
-        double value = (*this)[pos1] / f[pos2];
-        values.push_back(value);
-        partition += value;
+    DomainIterator it(*new_domain, { d1, d2 });
 
-        // find next valuation
-        new_domain->next_valuation(valuation);
+    double partition = 0;
+    vector<double> values(size);
+    if (_log) {
+        for (unsigned i = 0; i < size; ++i) {
+            values[i] = values1[it.position(0)] - values2[it.position(1)];
+            it.next();
+        }
+        partition = kernels::logsumexp(values.data(), size);
+    }
+    else {
+        for (unsigned i = 0; i < size; ++i) {
+            // set quotient factor value from positions of consistent valuations
+            assert(values2[it.position(1)] != 0);
+            double value = values1[it.position(0)] / values2[it.position(1)];
+            values[i] = value;
+            partition += value;
+
+            // find next valuation
+            it.next();
+        }
     }
 
-    Factor new_factor(new_domain, values, partition);
+    Factor new_factor(new_domain, move(values), partition);
+    new_factor._log = _log;
     return new_factor;
 }
 
@@ -186,70 +355,247 @@ Factor::sum_out(const Variable *variable) const
         Factor new_factor(*this);
         return new_factor;
     }
+    else if (_sparse) {
+        return sparse_sum_out(variable);
+    }
     else {
-        Domain *new_domain = new Domain(*this->_domain, variable);
-        Factor new_factor(new_domain, 0.0);
+        shared_ptr<const Domain> new_domain = Domain::intern(Domain(*_domain, variable));
+
+        // view values as a row-major [outer][card][inner] array
+        unsigned card = variable->size();
+        unsigned inner = _domain->stride(variable);
+        unsigned outer = size() / (card * inner);
+
+        // large outputs are split along the outer axis
+        vector<double> values(new_domain->size());
+        vector<double> partial = chunked(outer, chunks(values.size()), [&](unsigned begin, unsigned end) -> double {
+            const double *x = _values.data() + begin * card * inner;
+            double *y = values.data() + begin * inner;
+            if (_log) {
+                return kernels::logsumexp_axis(x, y, end - begin, card, inner);
+            }
+            return kernels::sum_axis(x, y, end - begin, card, inner);
+        });
 
-        unsigned factor_size = new_factor.size();
-        unsigned variable_size = variable->size();
+        Factor new_factor(new_domain, move(values), reduce_partition(partial, _log));
+        new_factor._log = _log;
+        return new_factor;
+    }
+}
 
-        double partition = 0;
+Factor
+Factor::eliminate(const vector<const Factor*> &factors, const Variable *variable, Arena *arena)
+{
+    // buckets with sparse factors are combined by the sparse product,
+    // starting from the sparse factors to keep intermediate results sparse
+    bool sparse_bucket = false;
+    for (auto pf : factors) {
+        sparse_bucket = sparse_bucket || pf->_sparse;
+    }
+    if (sparse_bucket) {
+        vector<const Factor*> bucket(factors);
+        stable_partition(bucket.begin(), bucket.end(), [](const Factor *pf) { return pf->_sparse; });
+        Factor product(1.0);
+        for (auto pf : bucket) {
+            product *= *pf;
+        }
+        return product.sum_out(variable);
+    }
 
-        vector<unsigned> valuation(new_factor.width(), 0);
-        for (unsigned i = 0; i < factor_size; ++i) {
-            for (unsigned val = 0; val < variable_size; ++val) {
-                unsigned pos = _domain->position_consistent_valuation(valuation, *new_domain, variable, val);
-                double value = (*this)[pos];
-                new_factor[i] += value;
-                partition += value;
+    // scope of the product without variable
+    vector<const Variable*> scope;
+    for (auto pf : factors) {
+        const Domain *d = pf->_domain.get();
+        for (unsigned i = 0; i < d->width(); ++i) {
+            const Variable *v = (*d)[i];
+            if (v != variable && find(scope.begin(), scope.end(), v) == scope.end()) {
+                scope.push_back(v);
             }
-            new_domain->next_valuation(valuation);
         }
-        new_factor._partition = partition;
+    }
+    shared_ptr<const Domain> new_domain = Domain::intern(Domain(scope));
+    unsigned size = new_domain->size();
 
-        return new_factor;
+    vector<const Domain*> domains;
+    for (auto pf : factors) {
+        domains.push_back(pf->_domain.get());
     }
+    // factors that depend on variable are indexed along its axis in the
+    // inner loop, the others are constant for each output valuation
+    vector<unsigned> dependent, independent;
+    vector<const double*> dependent_values, independent_values;
+    vector<unsigned> strides;
+    for (unsigned k = 0; k < factors.size(); ++k) {
+        unsigned stride = factors[k]->_domain->stride(variable);
+        if (stride > 0) {
+            dependent.push_back(k);
+            dependent_values.push_back(factors[k]->_values.data());
+            strides.push_back(stride);
+        }
+        else {
+            independent.push_back(k);
+            independent_values.push_back(factors[k]->_values.data());
+        }
+    }
+    unsigned ndependent = dependent.size();
+    unsigned nindependent = independent.size();
+    unsigned card = (ndependent > 0) ? variable->size() : 1;
+
+    // all factors of a bucket are in the same space
+    bool log_space = !factors.empty() && factors[0]->_log;
+
+    vector<double> values = arena ? arena->values(size) : vector<double>(size);
+    vector<double> partial = chunked(size, chunks(size), [&](unsigned begin, unsigned end) -> double {
+        DomainIterator it(*new_domain, domains);
+        it.seek(begin);
+
+        if (log_space) {
+            vector<double> terms(card);
+            for (unsigned i = begin; i < end; ++i) {
+                double c = 0.0;
+                for (unsigned j = 0; j < nindependent; ++j) {
+                    c += independent_values[j][it.position(independent[j])];
+                }
+
+                for (unsigned val = 0; val < card; ++val) {
+                    double p = 0.0;
+                    for (unsigned j = 0; j < ndependent; ++j) {
+                        p += dependent_values[j][it.position(dependent[j]) + val * strides[j]];
+                    }
+                    terms[val] = p;
+                }
+
+                values[i] = c + kernels::logsumexp(terms.data(), card);
+
+                it.next();
+            }
+            return kernels::logsumexp(values.data() + begin, end - begin);
+        }
+
+        double partition = 0;
+        for (unsigned i = begin; i < end; ++i) {
+            double c = 1.0;
+            for (unsigned j = 0; j < nindependent; ++j) {
+                c *= independent_values[j][it.position(independent[j])];
+            }
+
+            double sum = 0.0;
+            for (unsigned val = 0; val < card; ++val) {
+                double p = 1.0;
+                for (unsigned j = 0; j < ndependent; ++j) {
+                    p *= dependent_values[j][it.position(dependent[j]) + val * strides[j]];
+                }
+                sum += p;
+            }
+
+            double value = c * sum;
+            values[i] = value;
+            partition += value;
+
+            it.next();
+        }
+        return partition;
+    });
+
+    Factor new_factor(new_domain, move(values), reduce_partition(partial, log_space));
+    new_factor._log = log_space;
+    return new_factor;
 }
 
 Factor
 Factor::conditioning(const unordered_map<unsigned,unsigned> &evidence) const
 {
-    const Domain *d = _domain;
+    const Domain *d = _domain.get();
     unsigned width = d->width();
 
-    Factor new_factor(new Domain(*d, evidence));
+    // the values are read without bounds checks below
+    for (unsigned i = 0; i < width; ++i) {
+        auto it = evidence.find((*d)[i]->id());
+        if (it != evidence.end() && it->second >= (*d)[i]->size()) {
+            throw "Factor::conditioning: Evidence value out of range.";
+        }
+    }
+
+    if (_sparse) {
+        return sparse_conditioning(evidence);
+    }
+
+    shared_ptr<const Domain> new_domain = Domain::intern(Domain(*d, evidence));
+    unsigned size = new_domain->size();
 
-    // incorporate evidence in instantiation
+    // position of the evidence, the free variables are walked from there
     vector<unsigned> valuation(width, 0);
     d->update_valuation_with_evidence(valuation, evidence);
+    unsigned base = d->position_valuation(valuation);
 
-    double partition = 0;
-    unsigned new_factor_size = new_factor.size();
-    for (unsigned i = 0; i < new_factor_size; ++i) {
+    const double *old_values = _values.data();
+    vector<double> values(size);
+    vector<double> partial = chunked(size, chunks(size), [&](unsigned begin, unsigned end) -> double {
+        DomainIterator it(*new_domain, { d });
+        it.seek(begin);
+        double partition = 0;
+        for (unsigned i = begin; i < end; ++i) {
+            double value = old_values[base + it.position(0)];
+            values[i] = value;
+            partition += value;
+            it.next();
+        }
+        if (_log) {
+            return kernels::logsumexp(values.data() + begin, end - begin);
+        }
+        return partition;
+    });
 
-        // update new factor
-        unsigned pos = d->position_valuation(valuation);
-        double value = (*this)[pos];
-        new_factor[i] = value;
-        partition += value;
+    Factor new_factor(new_domain, move(values), reduce_partition(partial, _log));
+    new_factor._log = _log;
+    return new_factor;
+}
 
-        // find next valuation
-        d->next_valuation_with_evidence(valuation, evidence);
+Factor
+Factor::normalize() const {
+    Factor new_factor(*this);
+
+    // sparse factors store only their nonzeros
+    unsigned n = new_factor.nonzeros();
+    if (_log) {
+        kernels::shift(new_factor._values.data(), n, -new_factor._partition);
+        new_factor._partition = 0.0;
+    }
+    else {
+        kernels::scale(new_factor._values.data(), n, 1.0 / new_factor._partition);
+        new_factor._partition = 1.0;
     }
-    new_factor._partition = partition;
 
     return new_factor;
 }
 
 Factor
-Factor::normalize() const {
-    Factor new_factor(*this);
+Factor::log() const
+{
+    if (_log) return *this;
+    if (_sparse) return to_dense().log();
 
-    unsigned sz = new_factor.size();
-    for (unsigned i = 0; i < sz; ++i) {
-        new_factor._values[i] = new_factor._values[i] / new_factor._partition;
+    Factor new_factor(*this);
+    unsigned size = new_factor.size();
+    for (unsigned i = 0; i < size; ++i) {
+        new_factor._values[i] = std::log(_values[i]);
     }
-    new_factor._partition = 1.0;
+    new_factor._partition = std::log(_partition);
+    new_factor._log = true;
+
+    return new_factor;
+}
+
+Factor
+Factor::exp() const
+{
+    if (!_log) return *this;
+
+    Factor new_factor(*this);
+    unsigned size = new_factor.size();
+    kernels::exp(new_factor._values.data(), size);
+    new_factor._partition = kernels::sum(new_factor._values.data(), size);
+    new_factor._log = false;
 
     return new_factor;
 }
@@ -264,6 +610,12 @@ Factor::sampling(const unordered_map<unsigned,unsigned> &evidence) const
     prob /= rd.max();
 
     Factor f = conditioning(evidence);
+    if (f._log) {
+        f = f.exp();
+    }
+    if (f._sparse) {
+        f = f.to_dense();
+    }
     if (fabs(f.partition() - 1.0) > 0.001) {
         f = f.normalize();
     }
@@ -287,11 +639,193 @@ Factor::sampling(const unordered_map<unsigned,unsigned> &evidence) const
     return sample;
 }
 
+Factor
+Factor::to_sparse() const
+{
+    if (_sparse || _log) return *this;
+
+    vector<unsigned> index;
+    vector<double> values;
+    unsigned size = _values.size();
+    for (unsigned i = 0; i < size; ++i) {
+        if (_values[i] != 0.0) {
+            index.push_back(i);
+            values.push_back(_values[i]);
+        }
+    }
+
+    Factor new_factor(_domain, move(values), _partition);
+    new_factor._index = move(index);
+    new_factor._sparse = true;
+    return new_factor;
+}
+
+Factor
+Factor::to_dense() const
+{
+    if (!_sparse) return *this;
+
+    vector<double> values(size(), 0.0);
+    for (unsigned k = 0; k < _index.size(); ++k) {
+        values[_index[k]] = _values[k];
+    }
+    return Factor(_domain, move(values), _partition);
+}
+
+Factor
+Factor::from_entries(shared_ptr<const Domain> domain, vector<unsigned> index, vector<double> values, double partition)
+{
+    // results that filled up are cheaper to handle densely
+    if (values.size() > SPARSE_DENSITY * domain->size()) {
+        vector<double> dense(domain->size(), 0.0);
+        for (unsigned k = 0; k < index.size(); ++k) {
+            dense[index[k]] = values[k];
+        }
+        return Factor(move(domain), move(dense), partition);
+    }
+
+    Factor new_factor(move(domain), move(values), partition);
+    new_factor._index = move(index);
+    new_factor._sparse = true;
+    return new_factor;
+}
+
+template <typename Op>
+Factor
+Factor::sparse_combine(const Factor &f, Op op) const
+{
+    const Domain *d1 = _domain.get();
+    const Domain *d2 = f._domain.get();
+
+    shared_ptr<const Domain> new_domain = Domain::intern(Domain(*d1, *d2));
+
+    // the new domain lists the variables of d1 first, so each nonzero entry
+    // expands into a contiguous run of positions over the remaining ones
+    vector<const Variable*> extra_scope;
+    for (unsigned i = d1->width(); i < new_domain->width(); ++i) {
+        extra_scope.push_back((*new_domain)[i]);
+    }
+    Domain extra(extra_scope);
+    unsigned extra_size = extra.size();
+
+    unsigned width = d1->width();
+    vector<unsigned> cardinality(width), stride(width);
+    for (unsigned i = 0; i < width; ++i) {
+        cardinality[i] = (*d1)[i]->size();
+        stride[i] = d2->stride((*d1)[i]);
+    }
+
+    DomainIterator it(extra, { d2 });
+
+    vector<unsigned> index;
+    vector<double> values;
+    double partition = 0;
+    for (unsigned k = 0; k < _index.size(); ++k) {
+        // position in d2 of the shared variables
+        unsigned pos = _index[k];
+        unsigned base = 0;
+        for (int i = width-1; i >= 0; --i) {
+            base += (pos % cardinality[i]) * stride[i];
+            pos /= cardinality[i];
+        }
+
+        for (unsigned e = 0; e < extra_size; ++e) {
+            double value = op(_values[k], f[base + it.position(0)]);
+            if (value != 0.0) {
+                index.push_back(_index[k] * extra_size + e);
+                values.push_back(value);
+                partition += value;
+            }
+            it.next();
+        }
+    }
+
+    return from_entries(new_domain, move(index), move(values), partition);
+}
+
+Factor
+Factor::sparse_sum_out(const Variable *variable) const
+{
+    shared_ptr<const Domain> new_domain = Domain::intern(Domain(*_domain, variable));
+
+    // position [outer][value][inner] maps to [outer][inner]
+    unsigned card = variable->size();
+    unsigned inner = _domain->stride(variable);
+
+    vector<pair<unsigned,double>> entries;
+    entries.reserve(_index.size());
+    for (unsigned k = 0; k < _index.size(); ++k) {
+        unsigned pos = _index[k];
+        entries.push_back(make_pair((pos / (card * inner)) * inner + pos % inner, _values[k]));
+    }
+    sort(entries.begin(), entries.end(),
+        [](const pair<unsigned,double> &a, const pair<unsigned,double> &b) { return a.first < b.first; });
+
+    vector<unsigned> index;
+    vector<double> values;
+    for (auto const &entry : entries) {
+        if (!index.empty() && index.back() == entry.first) {
+            values.back() += entry.second;
+        }
+        else {
+            index.push_back(entry.first);
+            values.push_back(entry.second);
+        }
+    }
+
+    return from_entries(new_domain, move(index), move(values), _partition);
+}
+
+Factor
+Factor::sparse_conditioning(const unordered_map<unsigned,unsigned> &evidence) const
+{
+    const Domain *d = _domain.get();
+    shared_ptr<const Domain> new_domain = Domain::intern(Domain(*d, evidence));
+
+    // evidence variables must match, the others keep their digit
+    unsigned width = d->width();
+    vector<unsigned> cardinality(width), stride(width), observed(width);
+    vector<bool> is_observed(width);
+    for (unsigned i = 0; i < width; ++i) {
+        const Variable *v = (*d)[i];
+        auto it = evidence.find(v->id());
+        cardinality[i] = v->size();
+        stride[i] = new_domain->stride(v);
+        is_observed[i] = (it != evidence.end());
+        observed[i] = is_observed[i] ? it->second : 0;
+    }
+
+    vector<unsigned> index;
+    vector<double> values;
+    double partition = 0;
+    for (unsigned k = 0; k < _index.size(); ++k) {
+        unsigned pos = _index[k];
+        unsigned new_pos = 0;
+        bool consistent = true;
+        for (int i = width-1; i >= 0 && consistent; --i) {
+            unsigned digit = pos % cardinality[i];
+            pos /= cardinality[i];
+            if (is_observed[i]) {
+                consistent = (digit == observed[i]);
+            }
+            else {
+                new_pos += digit * stride[i];
+            }
+        }
+        if (consistent) {
+            index.push_back(new_pos);
+            values.push_back(_values[k]);
+            partition += _values[k];
+        }
+    }
+
+    return from_entries(new_domain, move(index), move(values), partition);
+}
 
 ostream&
 operator<<(ostream &os, const Factor &f)
 {
-    const Domain *domain = f._domain;
+    const Domain *domain = f._domain.get();
     int width = f.width();
     int size = f.size();
     double partition = f._partition;
@@ -299,7 +833,7 @@ operator<<(ostream &os, const Factor &f)
     os << "Factor(";
     os << "width:" << width << ", ";
     os << "size:" << size << ", ";
-    os << "partition:" << partition << ")" << endl;
+    os << (f._log ? "log-partition:" : "partition:") << partition << ")" << endl;
 
     // scope
     for (int i = 0; i < width; ++i) {
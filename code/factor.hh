@@ -4,13 +4,16 @@
 #include "domain.hh"
 
 #include <vector>
+#include <memory>
 
 namespace bn {
 
+class Arena;
+
 class Factor {
 public:
-    Factor(const Domain *domain, std::vector<double> values, double partition);
-    Factor(const Domain *domain, double value = 0.0);
+    Factor(std::shared_ptr<const Domain> domain, std::vector<double> values, double partition);
+    Factor(std::shared_ptr<const Domain> domain, double value = 0.0);
     Factor(double value = 1.0);
     Factor(const Factor &f);
     Factor(Factor &&f);
@@ -25,6 +28,13 @@ public:
     unsigned width()       const { return _domain->width(); }
     double partition()     const { return _partition; }
 
+    // log-space factors store log values and a log partition
+    bool log_space()       const { return _log; }
+
+    // sparse factors store the positions of their nonzero values only
+    bool sparse()          const { return _sparse; }
+    unsigned nonzeros()    const { return _values.size(); }
+
     const double &operator[](unsigned i) const;
     double &operator[](unsigned i);
 
@@ -37,14 +47,40 @@ public:
     Factor conditioning(const std::unordered_map<unsigned,unsigned> &evidence) const;
     Factor normalize() const;
 
+    Factor log() const;
+    Factor exp() const;
+
+    Factor to_sparse() const;
+    Factor to_dense() const;
+
+    // factors loaded with at most this fraction of nonzeros are stored sparse
+    static const double SPARSE_DENSITY;
+    static const unsigned SPARSE_MIN_SIZE;
+
+    // outputs with at least this many entries are split across the thread pool
+    static unsigned parallel_min_size;
+
+    static Factor eliminate(const std::vector<const Factor*> &factors, const Variable *variable, Arena *arena = nullptr);
+
     std::unordered_map<unsigned,unsigned> sampling(const std::unordered_map<unsigned,unsigned> &evidence) const;
 
     friend std::ostream &operator<<(std::ostream &os, const Factor &f);
+    friend class Arena;
 
 private:
-    const Domain *_domain;
+    std::shared_ptr<const Domain> _domain;
     std::vector<double> _values;
     double _partition;
+    bool _log;
+    bool _sparse;
+    std::vector<unsigned> _index;
+
+    template <typename Op>
+    Factor sparse_combine(const Factor &f, Op op) const;
+    Factor sparse_sum_out(const Variable *variable) const;
+    Factor sparse_conditioning(const std::unordered_map<unsigned,unsigned> &evidence) const;
+
+    static Factor from_entries(std::shared_ptr<const Domain> domain, std::vector<unsigned> index, std::vector<double> values, double partition);
 };
 
 }
@@ -1,115 +1,568 @@
 #include "graph.hh"
+#include "thread_pool.hh"
+#include "kernels.hh"
 
 #include <iostream>
+#include <algorithm>
+#include <iterator>
 #include <cmath>
+#include <climits>
+#include <chrono>
+#include <mutex>
 using namespace std;
 
 namespace bn {
 
-Graph::Graph(const vector<const Variable*> &variables, const vector<const Factor*> &factors) : _variables(variables)
+const unsigned Graph::DENSE_MAX_VERTICES = 8192;
+
+double Graph::order_budget = 0.0;
+
+Graph::Graph(const vector<const Variable*> &variables, const vector<const Factor*> &factors) :
+	_variables(variables),
+	_n(variables.size())
 {
 	for (auto const pf : factors) {
 		const Domain &domain = pf->domain();
-		unsigned width = domain.width();
-		for (unsigned i = 0; i < width; ++i) {
-			unordered_set<unsigned> empty_set;
-			_adj[domain[i]->id()] = empty_set;
+		for (unsigned i = 0; i < domain.width(); ++i) {
+			_n = max(_n, domain[i]->id() + 1);
 		}
 	}
 
+	_dense = (_n <= DENSE_MAX_VERTICES);
+	_words = (_n + 63) / 64;
+	if (_dense) {
+		_rows.assign((size_t) _n * _words, 0);
+	}
+	else {
+		_adj.resize(_n);
+	}
+	_degree.assign(_n, 0);
+	_vertex.assign(_n, false);
+
 	for (auto const pf : factors) {
 		const Domain &domain = pf->domain();
 		unsigned width = domain.width();
-
-		if (width == 0) continue;
-
-		for (unsigned i = 0; i < width-1; ++i) {
+		if (width > 0) {
+			_scopes.push_back(vector<unsigned>());
+		}
+		for (unsigned i = 0; i < width; ++i) {
+			_scopes.back().push_back(domain[i]->id());
+			_vertex[domain[i]->id()] = true;
 			for (unsigned j = i+1; j < width; ++j) {
-				const Variable *v1 = domain[i];
-				const Variable *v2 = domain[j];
-				_adj[v1->id()].insert(v2->id());
-				_adj[v2->id()].insert(v1->id());
+				add_edge(domain[i]->id(), domain[j]->id());
 			}
 		}
 	}
 }
 
-Graph::Graph(const Graph &g) : _variables(g._variables), _adj(g._adj)
+Graph::Graph(const Graph &g) :
+	_variables(g._variables),
+	_n(g._n),
+	_dense(g._dense),
+	_words(g._words),
+	_rows(g._rows),
+	_adj(g._adj),
+	_degree(g._degree),
+	_vertex(g._vertex),
+	_scopes(g._scopes)
 {
 }
 
+// Elimination score of a vertex: fill-in, then degree, then a tie-breaking rank.
+struct EliminationKey {
+	unsigned long score;
+	unsigned degree;
+	unsigned rank;
+	unsigned id;
+
+	bool operator<(const EliminationKey &k) const {
+		if (score != k.score) return score < k.score;
+		if (degree != k.degree) return degree < k.degree;
+		if (rank != k.rank) return rank < k.rank;
+		return id < k.id;
+	}
+};
+
+// Pending change of a message, largest first.
+struct ResidualKey {
+	double residual;
+	unsigned id;
+
+	bool operator<(const ResidualKey &k) const {
+		if (residual != k.residual) return residual > k.residual;
+		return id < k.id;
+	}
+};
+
+// Binary min-heap of ids that keeps the position of every id, so that the
+// key of an id can be changed in place.
+template <typename Key>
+class IndexedHeap {
+public:
+	IndexedHeap(unsigned n) : _position(n, -1) {}
+
+	bool empty() const { return _heap.empty(); }
+	bool contains(unsigned id) const { return _position[id] >= 0; }
+	const Key &top() const { return _heap[0]; }
+
+	void push(const Key &key) {
+		_position[key.id] = _heap.size();
+		_heap.push_back(key);
+		up(_heap.size()-1);
+	}
+
+	unsigned pop() {
+		unsigned id = _heap[0].id;
+		_position[id] = -1;
+		if (_heap.size() > 1) {
+			_heap[0] = _heap.back();
+			_position[_heap[0].id] = 0;
+			_heap.pop_back();
+			down(0);
+		}
+		else {
+			_heap.pop_back();
+		}
+		return id;
+	}
+
+	void update(const Key &key) {
+		unsigned i = _position[key.id];
+		_heap[i] = key;
+		up(i);
+		down(_position[key.id]);
+	}
+
+private:
+	std::vector<Key> _heap;
+	std::vector<int> _position;
+
+	void swap(unsigned i, unsigned j) {
+		std::swap(_heap[i], _heap[j]);
+		_position[_heap[i].id] = i;
+		_position[_heap[j].id] = j;
+	}
+
+	void up(unsigned i) {
+		while (i > 0 && _heap[i] < _heap[(i-1)/2]) {
+			swap(i, (i-1)/2);
+			i = (i-1)/2;
+		}
+	}
+
+	void down(unsigned i) {
+		while (true) {
+			unsigned smallest = i;
+			unsigned left = 2*i+1, right = 2*i+2;
+			if (left < _heap.size() && _heap[left] < _heap[smallest]) smallest = left;
+			if (right < _heap.size() && _heap[right] < _heap[smallest]) smallest = right;
+			if (smallest == i) return;
+			swap(i, smallest);
+			i = smallest;
+		}
+	}
+};
+
+vector<unsigned>
+Graph::neighbors(unsigned id) const
+{
+	if (!_dense) {
+		return _adj[id];
+	}
+
+	vector<unsigned> neighbors;
+	neighbors.reserve(_degree[id]);
+	const uint64_t *r = row(id);
+	for (unsigned k = 0; k < _words; ++k) {
+		for (uint64_t bits = r[k]; bits; bits &= bits - 1) {
+			neighbors.push_back(k * 64 + __builtin_ctzll(bits));
+		}
+	}
+	return neighbors;
+}
+
+bool
+Graph::connected(unsigned id1, unsigned id2) const
+{
+	if (_dense) {
+		return (row(id1)[id2 / 64] >> (id2 % 64)) & 1;
+	}
+	return binary_search(_adj[id1].begin(), _adj[id1].end(), id2);
+}
+
+void
+Graph::add_edge(unsigned id1, unsigned id2)
+{
+	if (id1 == id2 || connected(id1, id2)) return;
+
+	if (_dense) {
+		row(id1)[id2 / 64] |= uint64_t(1) << (id2 % 64);
+		row(id2)[id1 / 64] |= uint64_t(1) << (id1 % 64);
+	}
+	else {
+		_adj[id1].insert(lower_bound(_adj[id1].begin(), _adj[id1].end(), id2), id2);
+		_adj[id2].insert(lower_bound(_adj[id2].begin(), _adj[id2].end(), id1), id1);
+	}
+	_degree[id1]++;
+	_degree[id2]++;
+}
+
 vector<unsigned>
 Graph::ordering(
 	const vector<const Variable*> &variables,
 	unsigned &width,
 	unordered_map<string,bool> &options) const
 {
+	Heuristic heuristic = MIN_FILL;
+	if (options["min-degree"]) {
+		heuristic = MIN_DEGREE;
+	}
+	else if (options["weighted-min-fill"]) {
+		heuristic = WEIGHTED_MIN_FILL;
+	}
+
+	vector<unsigned> vars;
+	for (auto const pv : variables) {
+		vars.push_back(pv->id());
+	}
+
+	double cost;
+	return greedy(vars, heuristic, nullptr, HUGE_VAL, cost, width);
+}
+
+vector<unsigned>
+Graph::anytime_ordering(
+	const vector<const Variable*> &variables,
+	unsigned &width,
+	unordered_map<string,bool> &options) const
+{
+	vector<unsigned> best = ordering(variables, width, options);
+	if (order_budget <= 0 || best.size() < 2) {
+		return best;
+	}
+
+	auto deadline = chrono::steady_clock::now() + chrono::microseconds((long) (order_budget * 1000));
+	double best_cost = evaluate(best, HUGE_VAL, width);
+	mutex lock;
+
+	// start from the best of the greedy heuristics
+	for (auto heuristic : { MIN_FILL, WEIGHTED_MIN_FILL, MIN_DEGREE }) {
+		double cost;
+		unsigned w;
+		vector<unsigned> order = greedy(best, heuristic, nullptr, best_cost, cost, w);
+		if (!order.empty()) {
+			best.swap(order);
+			best_cost = cost;
+		}
+	}
+
+	// each thread alternates randomized greedy restarts, which give up as
+	// soon as they cost more than the best ordering, with a few moves of
+	// local search around the best ordering found so far
+	ThreadPool &pool = ThreadPool::instance();
+	TaskGroup group(pool);
+	for (unsigned t = 0; t < pool.threads(); ++t) {
+		group.run([&, t]() {
+			const Heuristic heuristics[] = { MIN_FILL, WEIGHTED_MIN_FILL, MIN_DEGREE };
+			mt19937 rng(t + 1);
+			for (unsigned restart = 0; chrono::steady_clock::now() < deadline; ++restart) {
+				double bound;
+				vector<unsigned> current;
+				{
+					lock_guard<mutex> guard(lock);
+					bound = best_cost;
+					current = best;
+				}
+
+				double cost;
+				unsigned w;
+				vector<unsigned> order = greedy(current, heuristics[restart % 3], &rng, bound, cost, w);
+				if (!order.empty()) {
+					current.swap(order);
+					bound = cost;
+				}
+
+				for (unsigned k = 0; k < 16 && chrono::steady_clock::now() < deadline; ++k) {
+					// move a variable a few positions away
+					vector<unsigned> candidate(current);
+					unsigned i = rng() % candidate.size();
+					unsigned j = min<unsigned>(candidate.size() - 1, i + 1 + rng() % 8);
+					if (rng() % 2) {
+						rotate(candidate.begin() + i, candidate.begin() + i + 1, candidate.begin() + j + 1);
+					}
+					else {
+						rotate(candidate.begin() + i, candidate.begin() + j, candidate.begin() + j + 1);
+					}
+
+					cost = evaluate(candidate, bound, w);
+					if (cost < bound) {
+						current.swap(candidate);
+						bound = cost;
+					}
+				}
 
+				lock_guard<mutex> guard(lock);
+				if (bound < best_cost) {
+					best_cost = bound;
+					best = current;
+				}
+			}
+		});
+	}
+	group.wait();
+
+	evaluate(best, HUGE_VAL, width);
+	return best;
+}
+
+double
+Graph::state_space(const vector<unsigned> &ordering) const
+{
+	unsigned width;
+	return evaluate(ordering, HUGE_VAL, width);
+}
+
+// Greedy elimination of vars by a heuristic. Scores are kept in a heap and
+// only those of the vertices around an eliminated one are recomputed, ties
+// are broken by degree and then id, or by a random rank when rng is given,
+// which also picks the second best vertex now and then. Returns an empty
+// ordering as soon as the state space of the cliques goes over bound.
+vector<unsigned>
+Graph::greedy(
+	const vector<unsigned> &vars,
+	Heuristic heuristic,
+	mt19937 *rng,
+	double bound,
+	double &cost,
+	unsigned &width) const
+{
 	Graph g(*this);
 
-	unordered_set<unsigned> vars;
-	for (auto const pv : variables) {
-		vars.insert(pv->id());
+	vector<unsigned> rank(_n, 0);
+	if (rng) {
+		for (auto &r : rank) {
+			r = (*rng)();
+		}
+	}
+
+	IndexedHeap<EliminationKey> heap(_n);
+	auto key = [&g, &rank, heuristic](unsigned id) {
+		return EliminationKey{ g.fill_in(id, heuristic), g.degree(id), rank[id], id };
+	};
+	for (auto const id : vars) {
+		if (!heap.contains(id)) {
+			heap.push(key(id));
+		}
 	}
 
 	vector<unsigned> ordering;
+	cost = 0.0;
 	width = 0;
 
-	while (!vars.empty()) {
+	while (!heap.empty()) {
+		unsigned next_var = heap.pop();
+		if (rng && !heap.empty() && (*rng)() % 8 == 0) {
+			unsigned second = heap.pop();
+			heap.push(key(next_var));
+			next_var = second;
+		}
+		ordering.push_back(next_var);
 
-		// find best next_var
-		unsigned next_var;
-		if (options["min-degree"]) {
-			next_var = g.min_degree(vars);
+		// update order width and state space
+		vector<unsigned> adj = g.neighbors(next_var);
+		unsigned w = adj.size();
+		if (w > width) {
+			width = w;
 		}
-		else if (options["weighted-min-fill"]) {
-			next_var = g.weighted_min_fill(vars);
+		double size = _variables.at(next_var)->size();
+		for (auto const id : adj) {
+			size *= _variables.at(id)->size();
 		}
-		else {
-			next_var = g.min_fill(vars);
+		cost += size;
+		if (cost >= bound) {
+			return vector<unsigned>();
 		}
-		ordering.push_back(next_var);
 
-		// update order width
-		unordered_set<unsigned> adj = g.neighbors(next_var);
-		unsigned w = adj.size();
+		// degrees change around next_var, fill-in also one step further
+		// when fill-in edges were added
+		bool filled = g.eliminate(next_var);
+		vector<unsigned> changed = adj;
+		if (filled && heuristic != MIN_DEGREE) {
+			for (auto const id : adj) {
+				vector<unsigned> adj2 = g.neighbors(id);
+				changed.insert(changed.end(), adj2.begin(), adj2.end());
+			}
+			sort(changed.begin(), changed.end());
+			changed.erase(unique(changed.begin(), changed.end()), changed.end());
+		}
+		for (auto const id : changed) {
+			if (heap.contains(id)) {
+				heap.update(key(id));
+			}
+		}
+	}
+
+	return ordering;
+}
+
+// State space of the cliques of an ordering, HUGE_VAL once it reaches bound.
+double
+Graph::evaluate(const vector<unsigned> &ordering, double bound, unsigned &width) const
+{
+	Graph g(*this);
+
+	double cost = 0.0;
+	width = 0;
+	for (auto const next_var : ordering) {
+		unsigned w = g.degree(next_var);
 		if (w > width) {
 			width = w;
 		}
 
-		// erase edges to next_var
-		for (auto const padj : adj) {
-			g._adj[padj].erase(next_var);
+		double size = _variables.at(next_var)->size();
+		if (g._dense) {
+			const uint64_t *r = g.row(next_var);
+			for (unsigned k = 0; k < _words; ++k) {
+				for (uint64_t bits = r[k]; bits; bits &= bits - 1) {
+					size *= _variables.at(k * 64 + __builtin_ctzll(bits))->size();
+				}
+			}
+		}
+		else {
+			for (auto const id : g._adj[next_var]) {
+				size *= _variables.at(id)->size();
+			}
+		}
+		cost += size;
+		if (cost >= bound) {
+			return HUGE_VAL;
 		}
 
-		// add fill-in edges
+		g.eliminate(next_var);
+	}
+	return cost;
+}
+
+// Number of fill-in edges of a vertex, weighted by the product of the
+// cardinalities of their ends for weighted min-fill, or its degree for
+// min-degree.
+unsigned long
+Graph::fill_in(unsigned id, Heuristic heuristic) const
+{
+	if (heuristic == MIN_DEGREE) {
+		return _degree[id];
+	}
+
+	vector<unsigned> adj = neighbors(id);
+	unsigned long fill_in = 0;
+
+	if (_dense && heuristic == MIN_FILL) {
+		// pairs of neighbors minus the edges among them
+		const uint64_t *r = row(id);
+		unsigned long common = 0;
+		for (auto const id1 : adj) {
+			const uint64_t *r1 = row(id1);
+			for (unsigned k = 0; k < _words; ++k) {
+				common += __builtin_popcountll(r[k] & r1[k]);
+			}
+		}
+		unsigned long d = adj.size();
+		return d * (d - 1) / 2 - common / 2;
+	}
+
+	if (_dense) {
+		// neighbors after id1 that are not adjacent to it
+		const uint64_t *r = row(id);
 		for (auto const id1 : adj) {
-			for (auto const id2 : adj) {
-				if (id1 != id2 && !g.connected(id1, id2)) {
-					g._adj[id1].insert(id2);
-					g._adj[id2].insert(id1);
+			const uint64_t *r1 = row(id1);
+			unsigned long weight = 0;
+			for (unsigned k = id1 / 64; k < _words; ++k) {
+				uint64_t bits = r[k] & ~r1[k];
+				if (k == id1 / 64) {
+					bits &= ~uint64_t(0) << (id1 % 64) << 1;
+				}
+				for (; bits; bits &= bits - 1) {
+					weight += _variables.at(k * 64 + __builtin_ctzll(bits))->size();
 				}
 			}
+			fill_in += weight * _variables.at(id1)->size();
 		}
+		return fill_in;
+	}
 
-		// delete next_var
-		g._adj.erase(next_var);
-		vars.erase(next_var);
+	for (unsigned i = 0; i < adj.size(); ++i) {
+		for (unsigned j = i+1; j < adj.size(); ++j) {
+			if (!connected(adj[i], adj[j])) {
+				if (heuristic == WEIGHTED_MIN_FILL) {
+					fill_in += (unsigned long) _variables.at(adj[i])->size() * _variables.at(adj[j])->size();
+				}
+				else {
+					fill_in++;
+				}
+			}
+		}
 	}
+	return fill_in;
+}
 
-	return ordering;
+// Remove a vertex and connect its neighbors, true if any edge was added.
+bool
+Graph::eliminate(unsigned id)
+{
+	if (!_vertex[id]) return false;
+
+	vector<unsigned> adj = neighbors(id);
+	bool filled = false;
+
+	if (_dense) {
+		uint64_t *r = row(id);
+		for (auto const id1 : adj) {
+			uint64_t *r1 = row(id1);
+			r1[id / 64] &= ~(uint64_t(1) << (id % 64));
+
+			// add fill-in edges from id1 to the other neighbors of id
+			unsigned added = 0;
+			for (unsigned k = 0; k < _words; ++k) {
+				uint64_t fresh = r[k] & ~r1[k];
+				if (k == id1 / 64) {
+					fresh &= ~(uint64_t(1) << (id1 % 64));
+				}
+				r1[k] |= fresh;
+				added += __builtin_popcountll(fresh);
+			}
+			_degree[id1] += added;
+			_degree[id1]--;
+			filled = filled || added > 0;
+		}
+		fill(r, r + _words, 0);
+	}
+	else {
+		for (auto const id1 : adj) {
+			vector<unsigned> merged;
+			merged.reserve(_adj[id1].size() + adj.size());
+			set_union(_adj[id1].begin(), _adj[id1].end(), adj.begin(), adj.end(), back_inserter(merged));
+			merged.erase(remove_if(merged.begin(), merged.end(), [id, id1](unsigned v) { return v == id || v == id1; }), merged.end());
+
+			filled = filled || merged.size() + 1 > _adj[id1].size();
+			_adj[id1].swap(merged);
+			_degree[id1] = _adj[id1].size();
+		}
+		_adj[id].clear();
+	}
+
+	_degree[id] = 0;
+	_vertex[id] = false;
+	return filled;
 }
 
 unsigned
 Graph::min_degree(const unordered_set<unsigned> &vars) const
 {
 	unsigned next_var = *(vars.begin());
-	unsigned min_degree = _adj.size()+1;
+	unsigned min_degree = _n+1;
 
 	for (auto id : vars) {
-		unordered_set<unsigned> adj = neighbors(id);
-		unsigned degree = adj.size();
-
+		unsigned degree = _degree[id];
 		if (degree < min_degree) {
 			next_var = id;
 			min_degree = degree;
@@ -123,29 +576,16 @@ unsigned
 Graph::min_fill(const unordered_set<unsigned> &vars) const
 {
 	unsigned next_var = *(vars.begin());
-	unsigned min_fill = _adj.size()+1;
+	unsigned long min_fill = fill_in(next_var, MIN_FILL);
 
 	for (auto id : vars) {
-		unordered_set<unsigned> adj = neighbors(id);
-
-		unsigned fill_in = 0;
-		for (auto const id1 : adj) {
-			for (auto const id2 : adj) {
-				if (id1 < id2 && !connected(id1, id2)) {
-					fill_in++;
-				}
-			}
-		}
-		if (fill_in < min_fill) {
+		unsigned long fill = fill_in(id, MIN_FILL);
+		if (fill < min_fill) {
 			next_var = id;
-			min_fill = fill_in;
+			min_fill = fill;
 		}
-		else if (fill_in == min_fill) { // use min-degree as tiebraker
-			unordered_set<unsigned> next_var_adj = neighbors(next_var);
-			if (adj.size() < next_var_adj.size()) {
-				next_var = id;
-				min_fill = fill_in;
-			}
+		else if (fill == min_fill && _degree[id] < _degree[next_var]) { // use min-degree as tiebraker
+			next_var = id;
 		}
 	}
 
@@ -156,38 +596,16 @@ unsigned
 Graph::weighted_min_fill(const unordered_set<unsigned> &vars) const
 {
 	unsigned next_var = *(vars.begin());
-	unordered_set<unsigned> next_var_adj = neighbors(next_var);
-
-	unsigned weighted_min_fill = 0;
-	for (auto const id1 : next_var_adj) {
-		for (auto const id2 : next_var_adj) {
-			if (id1 < id2 && !connected(id1, id2)) {
-				weighted_min_fill += _variables.at(id1)->size() * _variables.at(id2)->size();
-			}
-		}
-	}
+	unsigned long weighted_min_fill = fill_in(next_var, WEIGHTED_MIN_FILL);
 
 	for (auto id : vars) {
-		unordered_set<unsigned> adj = neighbors(id);
-
-		unsigned weighted_fill_in = 0;
-		for (auto const id1 : adj) {
-			for (auto const id2 : adj) {
-				if (id1 < id2 && !connected(id1, id2)) {
-					weighted_fill_in += _variables.at(id1)->size() * _variables.at(id2)->size();
-				}
-			}
-		}
-		if (weighted_fill_in < weighted_min_fill) {
+		unsigned long weighted_fill = fill_in(id, WEIGHTED_MIN_FILL);
+		if (weighted_fill < weighted_min_fill) {
 			next_var = id;
-			weighted_min_fill = weighted_fill_in;
+			weighted_min_fill = weighted_fill;
 		}
-		else if (weighted_fill_in == weighted_min_fill) { // min-degree
-			unordered_set<unsigned> next_var_adj = neighbors(next_var);
-			if (adj.size() < next_var_adj.size()) {
-				next_var = id;
-				weighted_min_fill = weighted_fill_in;
-			}
+		else if (weighted_fill == weighted_min_fill && _degree[id] < _degree[next_var]) { // min-degree
+			next_var = id;
 		}
 	}
 
@@ -199,53 +617,108 @@ Graph::order_width(const vector<const Variable*> &variables) const
 {
 	Graph g(*this);
 
-	vector<unsigned> vars;
-	for (auto const pv : variables) {
-		vars.push_back(pv->id());
-	}
-
 	unsigned width = 0;
-	for (auto next_var : vars) {
+	for (auto const pv : variables) {
 
 		// update order width
-		unordered_set<unsigned> adj = g.neighbors(next_var);
-		unsigned w = adj.size();
+		unsigned w = g.degree(pv->id());
 		if (w > width) {
 			width = w;
 		}
 
-		// delete next_var
-		g._adj.erase(next_var);
+		g.eliminate(pv->id());
+	}
+
+	return width;
+}
+
+OrderStats
+Graph::order_stats(const vector<unsigned> &ordering) const
+{
+	vector<unsigned> position(_n, UINT_MAX);
+	for (unsigned k = 0; k < ordering.size(); ++k) {
+		position[ordering[k]] = k;
+	}
 
-		// erase edges to next_var
-		for (auto const padj : adj) {
-			g._adj[padj].erase(next_var);
+	// factors in each bucket: the input factors of its variable and the
+	// messages of earlier buckets
+	vector<unsigned> nfactors(ordering.size(), 0);
+	for (auto const &scope : _scopes) {
+		unsigned first = UINT_MAX;
+		for (auto const id : scope) {
+			first = min(first, position[id]);
+		}
+		if (first != UINT_MAX) {
+			nfactors[first]++;
 		}
+	}
+
+	Graph g(*this);
+	OrderStats stats{ 0, 0.0, 0.0, 0.0, 0.0 };
+	for (unsigned k = 0; k < ordering.size(); ++k) {
+		unsigned id = ordering[k];
+		vector<unsigned> adj = g.neighbors(id);
+		stats.width = max(stats.width, (unsigned) adj.size());
 
-		// add fill-in edges
+		double message = 1.0;
+		unsigned next = UINT_MAX;
 		for (auto const id1 : adj) {
-			for (auto const id2 : adj) {
-				if (id1 != id2 && !g.connected(id1, id2)) {
-					g._adj[id1].insert(id2);
-					g._adj[id2].insert(id1);
-				}
-			}
+			message *= _variables.at(id1)->size();
+			next = min(next, position[id1]);
+		}
+		double clique = message * _variables.at(id)->size();
+
+		stats.max_clique = max(stats.max_clique, clique);
+		stats.state_space += clique;
+		stats.bytes += message * sizeof(double);
+		stats.madds += clique * max(1u, nfactors[k]);
+		if (next != UINT_MAX) {
+			nfactors[next]++;
 		}
+
+		g.eliminate(id);
 	}
+	return stats;
+}
 
-	return width;
+vector<vector<unsigned>>
+Graph::elimination_cliques(const vector<unsigned> &ordering) const
+{
+	Graph g(*this);
+
+	vector<vector<unsigned>> cliques;
+	for (auto next_var : ordering) {
+		vector<unsigned> clique = g.neighbors(next_var);
+		clique.push_back(next_var);
+		sort(clique.begin(), clique.end());
+		cliques.push_back(clique);
+
+		g.eliminate(next_var);
+	}
+
+	return cliques;
+}
+
+ostream &
+operator<<(ostream &os, const OrderStats &stats)
+{
+	os << "width:" << stats.width << ", ";
+	os << "max clique:" << stats.max_clique << ", ";
+	os << "state space:" << stats.state_space << ", ";
+	os << "bytes:" << stats.bytes << ", ";
+	os << "madds:" << stats.madds;
+	return os;
 }
 
 ostream &
 operator<<(ostream &os, const Graph &g)
 {
 	os << "Graph:" << endl;
-	for (auto it : g._adj) {
-		unsigned id = it.first;
-		unordered_set<unsigned> neighbors = it.second;
+	for (unsigned id = 0; id < g._n; ++id) {
+		if (!g._vertex[id]) continue;
 		os << id << " :";
-		for (auto id2 : neighbors) {
-			cout << " " << id2;
+		for (auto id2 : g.neighbors(id)) {
+			os << " " << id2;
 		}
 		os << endl;
 	}
@@ -253,153 +726,558 @@ operator<<(ostream &os, const Graph &g)
 	return os;
 }
 
-FactorGraph::FactorGraph(
+const unsigned OrderingCache::CAPACITY = 4096;
+
+OrderingCache &
+OrderingCache::instance()
+{
+	static OrderingCache cache;
+	return cache;
+}
+
+// Key of an ordering: the heuristic and the anytime budget, the sorted
+// variables to eliminate and the sorted factor scopes with cardinalities,
+// as weighted min-fill and the width statistics depend on them.
+vector<unsigned>
+OrderingCache::signature(
+	const vector<const Factor*> &factors,
 	const vector<const Variable*> &variables,
-	const vector<const Factor*> &factors)
-	: _variables(variables), _factors(factors)
+	unordered_map<string,bool> &options,
+	bool anytime)
 {
-	for (unsigned i = 0; i < _factors.size(); ++i) {
-		const Domain &d = _factors[i]->domain(); // factor scope
+	vector<unsigned> key;
+	key.push_back(options["min-degree"] ? 0 : options["weighted-min-fill"] ? 2 : 1);
+	key.push_back(anytime ? (unsigned) (Graph::order_budget * 1000) : 0);
 
-		// initialize messages
-		for (unsigned j = 0; j < d.width(); ++j) {
-			const Variable *v = d[j];
-			unsigned id = v->id();
-			unsigned r_j = v->size();
-			vector<const Variable*> sc;
-			sc.push_back(v);
-			_fact2var_msgs[i][id] = new Factor(new Domain(sc), 1.0/r_j);
-			_var2fact_msgs[id][i] = new Factor(new Domain(sc), 1.0/r_j);
+	vector<unsigned> vars;
+	for (auto const pv : variables) {
+		vars.push_back(pv->id());
+	}
+	sort(vars.begin(), vars.end());
+	key.push_back(vars.size());
+	key.insert(key.end(), vars.begin(), vars.end());
+
+	vector<vector<pair<unsigned,unsigned>>> scopes;
+	for (auto const pf : factors) {
+		const Domain &domain = pf->domain();
+		vector<pair<unsigned,unsigned>> scope;
+		for (unsigned i = 0; i < domain.width(); ++i) {
+			scope.push_back(make_pair(domain[i]->id(), domain[i]->size()));
+		}
+		sort(scope.begin(), scope.end());
+		scopes.push_back(move(scope));
+	}
+	sort(scopes.begin(), scopes.end());
+	for (auto const &scope : scopes) {
+		key.push_back(scope.size());
+		for (auto const &var : scope) {
+			key.push_back(var.first);
+			key.push_back(var.second);
 		}
 	}
+	return key;
+}
+
+size_t
+OrderingCache::KeyHash::operator()(const vector<unsigned> &key) const
+{
+	size_t h = key.size();
+	for (auto const x : key) {
+		h ^= x + 0x9e3779b9 + (h << 6) + (h >> 2);
+	}
+	return h;
 }
 
-FactorGraph::~FactorGraph()
+vector<unsigned>
+OrderingCache::ordering(
+	const vector<const Variable*> &model_variables,
+	const vector<const Factor*> &factors,
+	const vector<const Variable*> &variables,
+	OrderStats &stats,
+	unordered_map<string,bool> &options,
+	bool anytime)
 {
-	// deallocate messages in _fact2var_msgs
-	for (auto it1 : _fact2var_msgs) {
-		for (auto it2 : it1.second) {
-			delete it2.second;
+	anytime = anytime && Graph::order_budget > 0;
+	vector<unsigned> key = signature(factors, variables, options, anytime);
+	{
+		lock_guard<mutex> guard(_lock);
+		auto it = _entries.find(key);
+		if (it != _entries.end()) {
+			_hits++;
+			stats = it->second.stats;
+			return it->second.ordering;
 		}
-		it1.second.clear();
 	}
-	_fact2var_msgs.clear();
+	_misses++;
+
+	Graph g(model_variables, factors);
+	unsigned width;
+	Entry entry;
+	entry.ordering = anytime ? g.anytime_ordering(variables, width, options) : g.ordering(variables, width, options);
+	entry.stats = g.order_stats(entry.ordering);
+	stats = entry.stats;
+
+	lock_guard<mutex> guard(_lock);
+	if (_entries.size() >= CAPACITY) {
+		_entries.clear();
+	}
+	_entries[key] = entry;
+	return entry.ordering;
+}
+
+unsigned
+OrderingCache::size() const
+{
+	lock_guard<mutex> guard(_lock);
+	return _entries.size();
+}
+
+void
+OrderingCache::clear()
+{
+	lock_guard<mutex> guard(_lock);
+	_entries.clear();
+	_hits = 0;
+	_misses = 0;
+}
+
+ostream &
+operator<<(ostream &os, const OrderingCache &cache)
+{
+	os << "OrderingCache(entries:" << cache.size() << ", ";
+	os << "hits:" << cache.hits() << ", ";
+	os << "misses:" << cache.misses() << ")";
+	return os;
+}
+
+unsigned long FactorGraph::message_budget = 0;
+double FactorGraph::time_budget = 0.0;
+const unsigned FactorGraph::PARALLEL_MIN_EDGES = 4096;
+
+FactorGraph::FactorGraph(
+	const vector<const Variable*> &variables,
+	const vector<const Factor*> &factors,
+	bool log_space)
+	: _variables(variables), _log_space(log_space), _updates(0), _converged(false)
+{
+	unsigned nvars = _variables.size();
+	unsigned nfactors = factors.size();
+	unsigned max_width = 0;
+	unsigned max_card = 1;
+
+	// potentials and edges by factor
+	_factor_edges.push_back(0);
+	vector<unsigned> degree(nvars, 0);
+	unsigned nmsgs = 0;
+	for (unsigned i = 0; i < nfactors; ++i) {
+		Factor f = factors[i]->sparse() ? factors[i]->to_dense() : Factor(*factors[i]);
+		if (f.log_space() != _log_space) {
+			f = _log_space ? f.log() : f.exp();
+		}
 
-	// deallocate messages in _var2fact_msgs
-	for (auto it1 : _var2fact_msgs) {
-		for (auto it2 : it1.second) {
-			delete it2.second;
+		_potential_offset.push_back(_potentials.size());
+		for (unsigned k = 0; k < f.size(); ++k) {
+			_potentials.push_back(f[k]);
 		}
-		it1.second.clear();
+
+		const Domain &d = f.domain();
+		for (unsigned j = 0; j < d.width(); ++j) {
+			const Variable *v = d[j];
+			_edge_var.push_back(v->id());
+			_edge_factor.push_back(i);
+			_edge_stride.push_back(d.stride(v));
+			_edge_offset.push_back(nmsgs);
+			nmsgs += v->size();
+			degree[v->id()]++;
+			max_card = max(max_card, v->size());
+		}
+		_factor_edges.push_back(_edge_var.size());
+		max_width = max(max_width, d.width());
+	}
+
+	// edges by variable
+	_var_edges_begin.assign(nvars + 1, 0);
+	for (unsigned id = 0; id < nvars; ++id) {
+		_var_edges_begin[id+1] = _var_edges_begin[id] + degree[id];
+	}
+	_var_edges.resize(_edge_var.size());
+	vector<unsigned> next(_var_edges_begin.begin(), _var_edges_begin.end() - 1);
+	for (unsigned e = 0; e < _edge_var.size(); ++e) {
+		_var_edges[next[_edge_var[e]]++] = e;
+	}
+
+	// uniform initial messages
+	_var2fact_msgs.resize(nmsgs);
+	for (unsigned e = 0; e < _edge_var.size(); ++e) {
+		unsigned size = _variables[_edge_var[e]]->size();
+		double value = _log_space ? -log((double) size) : 1.0 / size;
+		fill(&_var2fact_msgs[_edge_offset[e]], &_var2fact_msgs[_edge_offset[e]] + size, value);
+	}
+	_fact2var_msgs = _var2fact_msgs;
+
+	_scratch.message.resize(max_card);
+	_scratch.valuation.resize(max_width);
+}
+
+// Split the rows of a CSR offsets array into n contiguous ranges with
+// about the same number of entries.
+static vector<unsigned>
+balanced_ranges(const vector<unsigned> &offsets, unsigned n)
+{
+	unsigned rows = offsets.size() - 1;
+	vector<unsigned> bounds(1, 0);
+	for (unsigned c = 1; c < n; ++c) {
+		unsigned target = (unsigned long) offsets.back() * c / n;
+		unsigned row = lower_bound(offsets.begin(), offsets.end(), target) - offsets.begin();
+		bounds.push_back(max(bounds.back(), min(row, rows)));
 	}
-	_var2fact_msgs.clear();
+	bounds.push_back(rows);
+	return bounds;
 }
 
 unsigned
 FactorGraph::update(unsigned max, double epsilon)
 {
+	_converged = false;
+
+	ThreadPool &pool = ThreadPool::instance();
+	unsigned nchunks = (pool.threads() > 1 && edges() >= PARALLEL_MIN_EDGES) ? 4 * pool.threads() : 1;
+	vector<unsigned> var_ranges = balanced_ranges(_var_edges_begin, nchunks);
+	vector<unsigned> factor_ranges = balanced_ranges(_factor_edges, nchunks);
+	vector<Scratch> scratch(nchunks, _scratch);
+
+	// max residual of each range, reduced after the phase
+	vector<double> errors(nchunks);
+	auto phase = [&](const vector<unsigned> &ranges, bool variables) {
+		TaskGroup group(pool);
+		for (unsigned c = 0; c < nchunks; ++c) {
+			group.run([&, c]() {
+				double maxerror = 0.0;
+				for (unsigned i = ranges[c]; i < ranges[c+1]; ++i) {
+					double err = variables ? update_variable(i, scratch[c]) : update_factor(i, scratch[c]);
+					maxerror = std::max(maxerror, err);
+				}
+				errors[c] = std::max(errors[c], maxerror);
+			});
+		}
+		group.wait();
+	};
+
 	unsigned iterations;
 	for (iterations = 0; iterations < max; ++iterations) {
-		double maxerror = 0.0;
-
-		// variable to factor
-		for (auto it : _var2fact_msgs) {
-			unsigned var_id = it.first;
-			for (auto it2 : it.second) {
-				unsigned fact_id = it2.first;
-				double err = update_variable_to_factor_msg(var_id, fact_id);
-				if (err > maxerror) {
-					maxerror = err;
-				}
-			}
+		fill(errors.begin(), errors.end(), 0.0);
+
+		// variable to factor, then factor to variable
+		phase(var_ranges, true);
+		phase(factor_ranges, false);
+		_updates += 2 * edges();
+
+		if (*max_element(errors.begin(), errors.end()) < epsilon) {
+			_converged = true;
+			break;
 		}
-		// factor to variable
-		for (auto it : _fact2var_msgs) {
-			unsigned fact_id = it.first;
-			for (auto it2 : it.second) {
-				unsigned var_id = it2.first;
-				double err = update_factor_to_variable_msg(fact_id, var_id);
-				if (err > maxerror) {
-					maxerror = err;
+	}
+
+	return iterations;
+}
+
+unsigned long
+FactorGraph::update_residual(double epsilon)
+{
+	auto start = chrono::steady_clock::now();
+	auto deadline = start + chrono::microseconds((long) (time_budget * 1000));
+	unsigned long applied = 0;
+
+	// variable-to-factor messages from the current factor-to-variable ones,
+	// not counted in updates() so that it matches the message budget
+	for (unsigned id = 0; id < _variables.size(); ++id) {
+		update_variable(id, _scratch);
+	}
+
+	// every factor-to-variable message is recomputed into pending, and
+	// the heap orders the edges by how much their message would change
+	vector<double> pending(_fact2var_msgs.size());
+	IndexedHeap<ResidualKey> heap(edges());
+	auto propose = [&](unsigned e) {
+		unsigned size = _variables[_edge_var[e]]->size();
+		double *msg = &pending[_edge_offset[e]];
+		factor_message(e, _scratch);
+		normalize(_scratch.message.data(), size);
+		copy(_scratch.message.begin(), _scratch.message.begin() + size, msg);
+
+		ResidualKey key{ change(&_fact2var_msgs[_edge_offset[e]], msg, size), e };
+		if (heap.contains(e)) heap.update(key);
+		else heap.push(key);
+	};
+	for (unsigned e = 0; e < edges(); ++e) {
+		propose(e);
+	}
+
+	// applied grows by the degree of each variable, the clock is read
+	// every 64 steps of the loop instead
+	for (unsigned long step = 0; !heap.empty() && heap.top().residual >= epsilon; ++step) {
+		if (message_budget > 0 && applied >= message_budget) break;
+		if (time_budget > 0 && step % 64 == 0 && chrono::steady_clock::now() >= deadline) break;
+
+		unsigned e = heap.pop();
+		unsigned var_id = _edge_var[e];
+		unsigned size = _variables[var_id]->size();
+		copy(&pending[_edge_offset[e]], &pending[_edge_offset[e]] + size, &_fact2var_msgs[_edge_offset[e]]);
+		applied++;
+
+		// the messages of the variable to its other factors change, and
+		// so do the pending messages of those factors to their other variables
+		for (unsigned k = _var_edges_begin[var_id]; k < _var_edges_begin[var_id+1]; ++k) {
+			unsigned e2 = _var_edges[k];
+			if (e2 == e) continue;
+
+			variable_message(var_id, k, _scratch);
+			store(&_var2fact_msgs[_edge_offset[e2]], size, _scratch);
+			applied++;
+
+			unsigned factor_id = _edge_factor[e2];
+			for (unsigned e3 = _factor_edges[factor_id]; e3 < _factor_edges[factor_id+1]; ++e3) {
+				if (e3 != e2) {
+					propose(e3);
 				}
 			}
 		}
-
-		if (maxerror < epsilon) break;
 	}
 
-	return iterations;
+	_converged = heap.empty() || heap.top().residual < epsilon;
+	_updates += applied;
+	return applied;
 }
 
-double
-FactorGraph::update_variable_to_factor_msg(unsigned var_id, unsigned factor_id)
+// Product of the messages to a variable from all factors but the one of
+// its k-th edge, into the scratch message.
+void
+FactorGraph::variable_message(unsigned var_id, unsigned k, Scratch &scratch) const
 {
-	vector<const Variable*> sc;
-	sc.push_back(_variables[var_id]);
-	Factor new_msg(new Domain(sc), 1.0);
-	for (auto it : _var2fact_msgs[var_id]) {
-		unsigned f_id = it.first;
-		if (f_id == factor_id) continue;
-		new_msg *= *(_fact2var_msgs[f_id][var_id]);
+	unsigned size = _variables[var_id]->size();
+	double *msg = scratch.message.data();
+	fill(msg, msg + size, _log_space ? 0.0 : 1.0);
+	for (unsigned k2 = _var_edges_begin[var_id]; k2 < _var_edges_begin[var_id+1]; ++k2) {
+		if (k2 == k) continue;
+		const double *in = &_fact2var_msgs[_edge_offset[_var_edges[k2]]];
+		for (unsigned x = 0; x < size; ++x) {
+			if (_log_space) msg[x] += in[x];
+			else msg[x] *= in[x];
+		}
 	}
-	new_msg = new_msg.normalize();
+}
 
-	const Factor *old_msg = _var2fact_msgs[var_id][factor_id];
-	double maxerror = 0.0;
-	for (unsigned i = 0; i < old_msg->size(); ++i) {
-		double old_val = (*old_msg)[i];
-		double new_val = new_msg[i];
-		double err = fabs(old_val - new_val) / old_val;
-		if (err > maxerror) {
-			maxerror = err;
+// Potential of the factor of edge e times the messages of its other
+// variables, summed over them, into the scratch message.
+void
+FactorGraph::factor_message(unsigned e, Scratch &scratch) const
+{
+	unsigned factor_id = _edge_factor[e];
+	unsigned begin = _factor_edges[factor_id];
+	unsigned end = _factor_edges[factor_id+1];
+	unsigned width = end - begin;
+	const double *potential = &_potentials[_potential_offset[factor_id]];
+
+	unsigned size = _variables[_edge_var[e]]->size();
+	double *msg = scratch.message.data();
+	unsigned *valuation = scratch.valuation.data();
+	fill(msg, msg + size, _log_space ? -HUGE_VAL : 0.0);
+
+	// visit the entries of the factor in order, last variable fastest
+	fill(valuation, valuation + width, 0);
+	unsigned entries = _edge_stride[begin] * _variables[_edge_var[begin]]->size();
+	for (unsigned i = 0; i < entries; ++i) {
+		double value = potential[i];
+		for (unsigned e2 = begin; e2 < end; ++e2) {
+			if (e2 == e) continue;
+			double in = _var2fact_msgs[_edge_offset[e2] + valuation[e2 - begin]];
+			if (_log_space) value += in;
+			else value *= in;
 		}
-	}
 
-	delete old_msg;
-	_var2fact_msgs[var_id][factor_id] = new Factor(new_msg);
+		double &out = msg[valuation[e - begin]];
+		if (!_log_space) {
+			out += value;
+		}
+		else if (value > -HUGE_VAL) {
+			double hi = std::max(out, value);
+			out = hi + log1p(exp(std::min(out, value) - hi));
+		}
 
+		for (int j = width - 1; j >= 0; --j) {
+			if (++valuation[j] < _variables[_edge_var[begin + j]]->size()) break;
+			valuation[j] = 0;
+		}
+	}
+}
+
+double
+FactorGraph::update_variable(unsigned var_id, Scratch &scratch)
+{
+	unsigned size = _variables[var_id]->size();
+	double maxerror = 0.0;
+	for (unsigned k = _var_edges_begin[var_id]; k < _var_edges_begin[var_id+1]; ++k) {
+		variable_message(var_id, k, scratch);
+		maxerror = max(maxerror, store(&_var2fact_msgs[_edge_offset[_var_edges[k]]], size, scratch));
+	}
 	return maxerror;
 }
 
 double
-FactorGraph::update_factor_to_variable_msg(unsigned factor_id, unsigned var_id)
+FactorGraph::update_factor(unsigned factor_id, Scratch &scratch)
+{
+	double maxerror = 0.0;
+	for (unsigned e = _factor_edges[factor_id]; e < _factor_edges[factor_id+1]; ++e) {
+		factor_message(e, scratch);
+		maxerror = max(maxerror, store(&_fact2var_msgs[_edge_offset[e]], _variables[_edge_var[e]]->size(), scratch));
+	}
+	return maxerror;
+}
+
+void
+FactorGraph::normalize(double *msg, unsigned size) const
 {
-	Factor new_msg(*_factors[factor_id]);
-	for (auto it : _fact2var_msgs[factor_id]) {
-		unsigned v_id = it.first;
-		if (v_id == var_id) continue;
-		new_msg *= *(_var2fact_msgs[v_id][factor_id]);
-		new_msg = new_msg.sum_out(_variables[v_id]);
+	if (_log_space) {
+		double norm = kernels::logsumexp(msg, size);
+		for (unsigned x = 0; x < size; ++x) {
+			msg[x] -= norm;
+		}
+	}
+	else {
+		double norm = 0.0;
+		for (unsigned x = 0; x < size; ++x) {
+			norm += msg[x];
+		}
+		for (unsigned x = 0; x < size; ++x) {
+			msg[x] /= norm;
+		}
 	}
-	new_msg = new_msg.normalize();
+}
 
-	const Factor *old_msg = _fact2var_msgs[factor_id][var_id];
+// Largest relative change between two messages, always measured on
+// linear values.
+double
+FactorGraph::change(const double *old_msg, const double *new_msg, unsigned size) const
+{
 	double maxerror = 0.0;
-	for (unsigned i = 0; i < old_msg->size(); ++i) {
-		double old_val = (*old_msg)[i];
-		double new_val = new_msg[i];
+	for (unsigned x = 0; x < size; ++x) {
+		double old_val = old_msg[x];
+		double new_val = new_msg[x];
+		if (old_val == new_val) continue;
+		if (_log_space) {
+			old_val = exp(old_val);
+			new_val = exp(new_val);
+		}
 		double err = fabs(old_val - new_val) / old_val;
 		if (err > maxerror) {
 			maxerror = err;
 		}
 	}
+	return maxerror;
+}
 
-	delete old_msg;
-	_fact2var_msgs[factor_id][var_id] = new Factor(new_msg);
-
+// Normalize the scratch message into msg and return how much msg changed.
+double
+FactorGraph::store(double *msg, unsigned size, Scratch &scratch) const
+{
+	normalize(scratch.message.data(), size);
+	double maxerror = change(msg, scratch.message.data(), size);
+	copy(scratch.message.begin(), scratch.message.begin() + size, msg);
 	return maxerror;
 }
 
 Factor
 FactorGraph::marginal(const Variable *v) const
 {
-	Factor marg(1.0);
 	unsigned var_id = v->id();
-	for (auto it : _var2fact_msgs.find(var_id)->second) {
-		unsigned fact_id = it.first;
-		marg *= *(_fact2var_msgs.find(fact_id)->second.find(var_id)->second);
+	unsigned size = v->size();
+	unsigned begin = _var_edges_begin[var_id];
+	unsigned end = _var_edges_begin[var_id+1];
+	if (begin == end) {
+		return Factor(1.0);
+	}
+
+	vector<double> values(size, _log_space ? 0.0 : 1.0);
+	for (unsigned k = begin; k < end; ++k) {
+		const double *in = &_fact2var_msgs[_edge_offset[_var_edges[k]]];
+		for (unsigned x = 0; x < size; ++x) {
+			if (_log_space) values[x] += in[x];
+			else values[x] *= in[x];
+		}
 	}
-	return marg.normalize();
+	if (_log_space) {
+		double norm = kernels::logsumexp(values.data(), size);
+		for (auto &value : values) {
+			value = exp(value - norm);
+		}
+	}
+
+	double partition = 0.0;
+	for (auto value : values) {
+		partition += value;
+	}
+	for (auto &value : values) {
+		value /= partition;
+	}
+	return Factor(Domain::intern(Domain(vector<const Variable*>(1, v))), move(values), 1.0);
+}
+
+double
+FactorGraph::log_partition() const
+{
+	double lz = 0.0;
+
+	// sum over factors of the expected log potential plus the entropy of the factor belief
+	vector<double> belief;
+	vector<unsigned> valuation;
+	for (unsigned factor_id = 0; factor_id + 1 < _factor_edges.size(); ++factor_id) {
+		unsigned begin = _factor_edges[factor_id];
+		unsigned end = _factor_edges[factor_id+1];
+		unsigned width = end - begin;
+		const double *potential = &_potentials[_potential_offset[factor_id]];
+		unsigned entries = (width == 0) ? 1 : _edge_stride[begin] * _variables[_edge_var[begin]]->size();
+
+		// unnormalized log belief, last variable fastest
+		belief.resize(entries);
+		valuation.assign(width, 0);
+		for (unsigned i = 0; i < entries; ++i) {
+			double value = _log_space ? potential[i] : log(potential[i]);
+			for (unsigned e = begin; e < end; ++e) {
+				double in = _var2fact_msgs[_edge_offset[e] + valuation[e - begin]];
+				value += _log_space ? in : log(in);
+			}
+			belief[i] = value;
+			for (int j = width - 1; j >= 0; --j) {
+				if (++valuation[j] < _variables[_edge_var[begin + j]]->size()) break;
+				valuation[j] = 0;
+			}
+		}
+
+		double norm = kernels::logsumexp(belief.data(), entries);
+		if (norm == -HUGE_VAL) {
+			return -HUGE_VAL;
+		}
+		for (unsigned i = 0; i < entries; ++i) {
+			if (belief[i] == -HUGE_VAL) continue;
+			double log_potential = _log_space ? potential[i] : log(potential[i]);
+			double log_belief = belief[i] - norm;
+			lz += exp(log_belief) * (log_potential - log_belief);
+		}
+	}
+
+	// minus the entropy of each variable belief once per extra factor
+	for (unsigned id = 0; id < _variables.size(); ++id) {
+		unsigned degree = _var_edges_begin[id+1] - _var_edges_begin[id];
+		if (degree < 2) continue;
+		Factor b = marginal(_variables[id]);
+		for (unsigned x = 0; x < b.size(); ++x) {
+			if (b[x] > 0.0) {
+				lz += (degree - 1) * b[x] * log(b[x]);
+			}
+		}
+	}
+
+	return lz;
 }
 
 }
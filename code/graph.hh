@@ -4,54 +4,231 @@
 #include "variable.hh"
 #include "factor.hh"
 
+#include <ostream>
+#include <atomic>
+#include <mutex>
 #include <vector>
+#include <cstdint>
+#include <random>
 #include <unordered_map>
 #include <unordered_set>
 
 namespace bn {
 
+	// Cost of eliminating variables in a given order: the largest clique
+	// table, the sum of all clique tables, the bytes of the intermediate
+	// factors and the multiply-adds of their bucket products.
+	struct OrderStats {
+		unsigned width;
+		double max_clique;
+		double state_space;
+		double bytes;
+		double madds;
+	};
+
+	std::ostream &operator<<(std::ostream &os, const OrderStats &stats);
+
+	// Undirected graph over dense variable ids. Adjacency is kept as one
+	// bitset row per vertex, so that fill-in is counted with popcounts of
+	// AND-ed rows, or as sorted neighbor lists for models too large for an
+	// n x n bit matrix.
 	class Graph {
 	public:
 		Graph(const std::vector<const Variable*> &variables, const std::vector<const Factor*> &factors);
 		Graph(const Graph &g);
 
-		std::unordered_set<unsigned> neighbors(unsigned id) const { return _adj.find(id)->second; };
-		bool connected(unsigned id1, unsigned id2) const { return _adj.find(id1)->second.count(id2); };
+		std::vector<unsigned> neighbors(unsigned id) const;
+		unsigned degree(unsigned id) const { return _degree[id]; };
+		bool connected(unsigned id1, unsigned id2) const;
 
 		std::vector<unsigned> ordering(
 			const std::vector<const Variable*> &variables,
 			unsigned &width,
 			std::unordered_map<std::string,bool> &options) const;
 
+		// greedy ordering improved by randomized restarts and local search
+		// on the thread pool for order_budget milliseconds
+		std::vector<unsigned> anytime_ordering(
+			const std::vector<const Variable*> &variables,
+			unsigned &width,
+			std::unordered_map<std::string,bool> &options) const;
+
+		// total number of entries of the cliques of an ordering
+		double state_space(const std::vector<unsigned> &ordering) const;
+
 		unsigned min_fill(const std::unordered_set<unsigned> &vars) const;
 		unsigned weighted_min_fill(const std::unordered_set<unsigned> &vars) const;
 		unsigned min_degree(const std::unordered_set<unsigned> &vars) const;
 
 		unsigned order_width(const std::vector<const Variable*> &variables) const;
+		OrderStats order_stats(const std::vector<unsigned> &ordering) const;
+
+		// clique formed by each variable of the ordering when it is eliminated
+		std::vector<std::vector<unsigned>> elimination_cliques(const std::vector<unsigned> &ordering) const;
+
+		// graphs with at most this many vertices use bitset rows
+		static const unsigned DENSE_MAX_VERTICES;
+
+		// time given to anytime_ordering, 0 keeps the greedy ordering
+		static double order_budget;
 
 		friend std::ostream &operator<<(std::ostream &os, const Graph &g);
 
 	private:
 		const std::vector<const Variable*> _variables;
-		std::unordered_map<unsigned,std::unordered_set<unsigned>> _adj;
+		unsigned _n;
+		bool _dense;
+		unsigned _words;                         // 64-bit words per bitset row
+		std::vector<uint64_t> _rows;             // dense: _rows[id*_words + k]
+		std::vector<std::vector<unsigned>> _adj; // sparse: sorted neighbors
+		std::vector<unsigned> _degree;
+		std::vector<bool> _vertex;               // variables in the scope of some factor, not yet eliminated
+		std::vector<std::vector<unsigned>> _scopes;
+
+		enum Heuristic { MIN_DEGREE, MIN_FILL, WEIGHTED_MIN_FILL };
+
+		const uint64_t *row(unsigned id) const { return &_rows[id * _words]; }
+		uint64_t *row(unsigned id) { return &_rows[id * _words]; }
+
+		void add_edge(unsigned id1, unsigned id2);
+		unsigned long fill_in(unsigned id, Heuristic heuristic) const;
+		bool eliminate(unsigned id);
+
+		std::vector<unsigned> greedy(
+			const std::vector<unsigned> &vars,
+			Heuristic heuristic,
+			std::mt19937 *rng,
+			double bound,
+			double &cost,
+			unsigned &width) const;
+		double evaluate(const std::vector<unsigned> &ordering, double bound, unsigned &width) const;
+	};
+
+	// Elimination orderings memoized by the variables to eliminate, the
+	// factor scopes and the heuristic, so that repeated queries over the
+	// same subgraph skip building the graph and running the heuristic.
+	class OrderingCache {
+	public:
+		static OrderingCache &instance();
+
+		// greedy ordering of the heuristic in the options, improved for
+		// Graph::order_budget milliseconds when anytime is set
+		std::vector<unsigned> ordering(
+			const std::vector<const Variable*> &model_variables,
+			const std::vector<const Factor*> &factors,
+			const std::vector<const Variable*> &variables,
+			OrderStats &stats,
+			std::unordered_map<std::string,bool> &options,
+			bool anytime = true);
+
+		unsigned size() const;
+		unsigned long hits()   const { return _hits;   }
+		unsigned long misses() const { return _misses; }
+		void clear();
+
+		// entries kept before the cache is emptied
+		static const unsigned CAPACITY;
+
+		friend std::ostream &operator<<(std::ostream &os, const OrderingCache &cache);
+
+	private:
+		struct Entry {
+			std::vector<unsigned> ordering;
+			OrderStats stats;
+		};
+
+		struct KeyHash {
+			size_t operator()(const std::vector<unsigned> &key) const;
+		};
+
+		OrderingCache() : _hits(0), _misses(0) {}
+
+		mutable std::mutex _lock;
+		std::unordered_map<std::vector<unsigned>,Entry,KeyHash> _entries;
+		std::atomic<unsigned long> _hits;
+		std::atomic<unsigned long> _misses;
+
+		static std::vector<unsigned> signature(
+			const std::vector<const Factor*> &factors,
+			const std::vector<const Variable*> &variables,
+			std::unordered_map<std::string,bool> &options,
+			bool anytime);
 	};
 
+	// Loopy belief propagation on the factor graph of a model. Edges are
+	// kept in CSR arrays grouped by factor and by variable, and messages
+	// live in two contiguous buffers at per-edge offsets, so iterations
+	// update them in place without allocating.
 	class FactorGraph {
 	public:
-		FactorGraph(const std::vector<const Variable*> &variables, const std::vector<const Factor*> &factors);
-		~FactorGraph();
+		FactorGraph(const std::vector<const Variable*> &variables, const std::vector<const Factor*> &factors, bool log_space = false);
 
+		// synchronous sweeps over all messages, returns the number of sweeps;
+		// each phase reads the messages written by the previous one, so the
+		// edges of a phase are split across the thread pool
 		unsigned update(unsigned max, double epsilon);
+
+		// residual belief propagation: always apply the pending message
+		// with the largest change, within message_budget and time_budget
+		unsigned long update_residual(double epsilon);
+
 		Factor marginal(const Variable *v) const;
 
+		// Bethe estimate of the log partition function from the current
+		// factor and variable beliefs, exact when the graph is a tree
+		double log_partition() const;
+
+		unsigned edges() const { return _edge_var.size(); }
+		unsigned long updates() const { return _updates; }
+		bool converged() const { return _converged; }
+
+		// messages applied and milliseconds spent by update_residual, 0 for no limit
+		static unsigned long message_budget;
+		static double time_budget;
+
+		// graphs with fewer edges are updated on a single thread
+		static const unsigned PARALLEL_MIN_EDGES;
+
 	private:
 		std::vector<const Variable*> _variables;
-		std::vector<const Factor*> _factors;
-		std::unordered_map<unsigned,std::unordered_map<unsigned,const Factor*>> _var2fact_msgs;
-		std::unordered_map<unsigned,std::unordered_map<unsigned,const Factor*>> _fact2var_msgs;
-
-		double update_variable_to_factor_msg(unsigned var_id, unsigned factor_id);
-		double update_factor_to_variable_msg(unsigned factor_id, unsigned var_id);
+		bool _log_space;
+
+		// dense potentials of all factors, log values in log space
+		std::vector<double> _potentials;
+		std::vector<unsigned> _potential_offset;
+
+		// edges of factor f are _factor_edges[f] .. _factor_edges[f+1]-1,
+		// in the order of the factor scope
+		std::vector<unsigned> _factor_edges;
+		std::vector<unsigned> _edge_var;
+		std::vector<unsigned> _edge_factor;
+		std::vector<unsigned> _edge_stride;   // stride of the variable in the factor
+		std::vector<unsigned> _edge_offset;   // offset of the messages of the edge
+
+		// edges of variable v are _var_edges[_var_edges_begin[v] .. _var_edges_begin[v+1]-1]
+		std::vector<unsigned> _var_edges_begin;
+		std::vector<unsigned> _var_edges;
+
+		std::vector<double> _var2fact_msgs;
+		std::vector<double> _fact2var_msgs;
+
+		unsigned long _updates;   // messages applied so far
+		bool _converged;
+
+		// space for one message and one factor valuation, one per thread
+		struct Scratch {
+			std::vector<double> message;
+			std::vector<unsigned> valuation;
+		};
+		Scratch _scratch;
+
+		void variable_message(unsigned var_id, unsigned k, Scratch &scratch) const;
+		void factor_message(unsigned e, Scratch &scratch) const;
+		double update_variable(unsigned var_id, Scratch &scratch);
+		double update_factor(unsigned factor_id, Scratch &scratch);
+		void normalize(double *msg, unsigned size) const;
+		double change(const double *old_msg, const double *new_msg, unsigned size) const;
+		double store(double *msg, unsigned size, Scratch &scratch) const;
 	};
 
 }
@@ -69,7 +69,7 @@ read_factors(ifstream &input_file, vector<Variable*> &variables, vector<Factor*>
     unsigned order;
     read_next_integer(input_file, order);
 
-    vector<Domain*> domains;
+    vector<shared_ptr<const Domain>> domains;
     for (unsigned i = 0; i < order; ++i) {
         unsigned width;
         read_next_integer(input_file, width);
@@ -80,7 +80,7 @@ read_factors(ifstream &input_file, vector<Variable*> &variables, vector<Factor*>
             read_next_integer(input_file, id);
             scope.push_back(variables[id]);
         }
-        domains.push_back(new Domain(scope));
+        domains.push_back(Domain::intern(Domain(scope)));
     }
 
     for (unsigned i = 0; i < order; ++i) {
@@ -89,13 +89,21 @@ read_factors(ifstream &input_file, vector<Variable*> &variables, vector<Factor*>
 
         vector<double> values;
         double partition = 0;
+        unsigned nonzeros = 0;
         for (unsigned j = 0; j < factor_size; ++j) {
             double value;
             read_next_double(input_file, value);
             values.push_back(value);
             partition += value;
+            if (value != 0.0) nonzeros++;
         }
-        factors.push_back(new Factor(domains[i], values, partition));
+        Factor *factor = new Factor(domains[i], values, partition);
+
+        // store large zero-heavy tables sparsely
+        if (factor_size >= Factor::SPARSE_MIN_SIZE && nonzeros <= Factor::SPARSE_DENSITY * factor_size) {
+            *factor = factor->to_sparse();
+        }
+        factors.push_back(factor);
     }
 }
 
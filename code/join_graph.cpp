@@ -0,0 +1,276 @@
+#include "join_graph.hh"
+#include "graph.hh"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <set>
+#include <utility>
+using namespace std;
+
+namespace bn {
+
+unsigned JoinGraph::ibound = 8;
+
+JoinGraph::JoinGraph(
+	const vector<const Variable*> &variables,
+	const vector<const Factor*> &factors,
+	unordered_map<string,bool> &options)
+	: _variables(variables),
+	  _home(variables.size(), -1),
+	  _log_space(options["log-space"]),
+	  _updates(0),
+	  _converged(false)
+{
+	// only variables in the scope of some factor are in the graph
+	vector<bool> used(_variables.size(), false);
+	for (auto const pf : factors) {
+		const Domain &d = pf->domain();
+		for (unsigned i = 0; i < d.width(); ++i) {
+			used[d[i]->id()] = true;
+		}
+	}
+	vector<const Variable*> graph_variables;
+	for (auto const pv : _variables) {
+		if (used[pv->id()]) {
+			graph_variables.push_back(pv);
+		}
+	}
+
+	Graph g(_variables, factors);
+	unsigned order_width;
+	vector<unsigned> ordering = g.ordering(graph_variables, order_width, options);
+	vector<unsigned> position(_variables.size(), UINT_MAX);
+	for (unsigned k = 0; k < ordering.size(); ++k) {
+		position[ordering[k]] = k;
+	}
+
+	// functions of a bucket are input factors or the messages of earlier
+	// mini-buckets, and go to the bucket of their earliest eliminated variable
+	struct Function {
+		set<unsigned> scope;
+		const Factor *factor;
+		int cluster;
+	};
+	vector<vector<Function>> buckets(ordering.size());
+	auto place = [&](Function f) {
+		unsigned next = UINT_MAX;
+		for (auto id : f.scope) {
+			next = min(next, position[id]);
+		}
+		if (next != UINT_MAX) {
+			buckets[next].push_back(move(f));
+		}
+	};
+	for (auto const pf : factors) {
+		const Domain &d = pf->domain();
+		set<unsigned> scope;
+		for (unsigned i = 0; i < d.width(); ++i) {
+			scope.insert(d[i]->id());
+		}
+		place(Function{ scope, pf, -1 });
+	}
+
+	unsigned bound = max(ibound, 1u);
+	for (unsigned k = 0; k < ordering.size(); ++k) {
+		vector<Function> &bucket = buckets[k];
+		if (bucket.empty()) continue;
+
+		// first-fit partition into mini-buckets of at most ibound variables,
+		// largest functions first
+		stable_sort(bucket.begin(), bucket.end(), [](const Function &f1, const Function &f2) {
+			return f1.scope.size() > f2.scope.size();
+		});
+		vector<set<unsigned>> scopes;
+		vector<vector<const Function*>> minibuckets;
+		for (auto const &f : bucket) {
+			unsigned j = 0;
+			for (; j < scopes.size(); ++j) {
+				set<unsigned> scope(scopes[j]);
+				scope.insert(f.scope.begin(), f.scope.end());
+				if (scope.size() <= bound) break;
+			}
+			if (j == scopes.size()) {
+				scopes.push_back(set<unsigned>());
+				minibuckets.push_back(vector<const Function*>());
+			}
+			scopes[j].insert(f.scope.begin(), f.scope.end());
+			minibuckets[j].push_back(&f);
+		}
+
+		vector<Function> messages;
+		for (unsigned j = 0; j < scopes.size(); ++j) {
+			unsigned c = _clusters.size();
+			Cluster cluster;
+			for (auto id : scopes[j]) {
+				cluster.scope.push_back(_variables[id]);
+			}
+			cluster.potential = _log_space ? Factor(1.0).log() : Factor(1.0);
+			for (auto const f : minibuckets[j]) {
+				if (f->factor) {
+					cluster.potential *= _log_space ? f->factor->log() : *f->factor;
+				}
+			}
+			_clusters.push_back(move(cluster));
+
+			for (auto const f : minibuckets[j]) {
+				if (f->cluster >= 0) {
+					add_edge(f->cluster, c, vector<unsigned>(f->scope.begin(), f->scope.end()));
+				}
+			}
+			if (j > 0) {
+				add_edge(c - 1, c, vector<unsigned>(1, ordering[k]));
+			}
+
+			set<unsigned> scope(scopes[j]);
+			scope.erase(ordering[k]);
+			messages.push_back(Function{ scope, nullptr, (int) c });
+		}
+		for (auto &f : messages) {
+			place(move(f));
+		}
+	}
+
+	for (unsigned c = 0; c < _clusters.size(); ++c) {
+		for (auto const pv : _clusters[c].scope) {
+			int &home = _home[pv->id()];
+			if (home < 0 || _clusters[c].scope.size() < _clusters[home].scope.size()) {
+				home = c;
+			}
+		}
+	}
+}
+
+void
+JoinGraph::add_edge(unsigned c1, unsigned c2, const vector<unsigned> &separator)
+{
+	for (auto const &it : { make_pair(c1, c2), make_pair(c2, c1) }) {
+		Edge edge{ it.first, it.second, {}, _log_space ? Factor(1.0).log() : Factor(1.0) };
+		for (auto const pv : _clusters[it.first].scope) {
+			if (find(separator.begin(), separator.end(), pv->id()) == separator.end()) {
+				edge.eliminated.push_back(pv);
+			}
+		}
+		_clusters[it.first].edges.push_back(_edges.size());
+		_edges.push_back(move(edge));
+	}
+}
+
+unsigned
+JoinGraph::update(unsigned max, double epsilon)
+{
+	_converged = false;
+
+	unsigned iterations = 0;
+	while (iterations < max && !_converged) {
+		double error = 0.0;
+
+		// forward along the bucket order, then backward
+		for (unsigned c = 0; c < _clusters.size(); ++c) {
+			for (auto e : _clusters[c].edges) {
+				if (_edges[e].to > c) {
+					error = std::max(error, send(e));
+				}
+			}
+		}
+		for (unsigned c = _clusters.size(); c-- > 0; ) {
+			for (auto e : _clusters[c].edges) {
+				if (_edges[e].to < c) {
+					error = std::max(error, send(e));
+				}
+			}
+		}
+
+		iterations++;
+		_converged = (error < epsilon);
+	}
+	return iterations;
+}
+
+Factor
+JoinGraph::belief(unsigned c, int except) const
+{
+	Factor b(_clusters[c].potential);
+	for (auto e : _clusters[c].edges) {
+		unsigned incoming = e ^ 1;
+		if ((int) incoming != except) {
+			b *= _edges[incoming].message;
+		}
+	}
+	return b;
+}
+
+double
+JoinGraph::send(unsigned e)
+{
+	Edge &edge = _edges[e];
+
+	Factor m = belief(edge.from, e ^ 1);
+	for (auto const pv : edge.eliminated) {
+		m = m.sum_out(pv);
+	}
+	m = m.normalize();
+	if (m.sparse()) {
+		m = m.to_dense();
+	}
+
+	// the first message replaces the constant initial one
+	double change = 1.0;
+	const Factor &old = edge.message;
+	if (!old.sparse() && old.domain().scope() == m.domain().scope()) {
+		change = 0.0;
+		for (unsigned i = 0; i < m.size(); ++i) {
+			double a = m[i], b = old[i];
+			if (_log_space) {
+				a = std::exp(a);
+				b = std::exp(b);
+			}
+			change = std::max(change, fabs(a - b));
+		}
+	}
+
+	edge.message = move(m);
+	_updates++;
+	return change;
+}
+
+Factor
+JoinGraph::marginal(const Variable *v) const
+{
+	int c = _home[v->id()];
+	if (c < 0) {
+		return Factor(1.0);
+	}
+
+	Factor b = belief(c, -1);
+	for (auto const pv : _clusters[c].scope) {
+		if (pv != v) {
+			b = b.sum_out(pv);
+		}
+	}
+	return b.normalize().exp();
+}
+
+unsigned
+JoinGraph::width() const
+{
+	unsigned width = 0;
+	for (auto const &cluster : _clusters) {
+		width = max(width, (unsigned) cluster.scope.size());
+	}
+	return width;
+}
+
+ostream &
+operator<<(ostream &os, const JoinGraph &jg)
+{
+	os << "JoinGraph(";
+	os << "clusters:" << jg.size() << ", ";
+	os << "edges:" << jg._edges.size() / 2 << ", ";
+	os << "ibound:" << JoinGraph::ibound << ", ";
+	os << "width:" << jg.width() << ", ";
+	os << "updates:" << jg.updates() << ")";
+	return os;
+}
+
+}
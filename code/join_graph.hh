@@ -0,0 +1,75 @@
+#ifndef _BN_JOIN_GRAPH_H_
+#define _BN_JOIN_GRAPH_H_
+
+#include "variable.hh"
+#include "factor.hh"
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace bn {
+
+	// Join graph for iterative join-graph propagation (IJGP). Clusters are
+	// the mini-buckets of bucket elimination along a greedy ordering, each
+	// over at most ibound variables unless a single input factor is wider.
+	// The message of a mini-bucket links it
+	// to the cluster that receives it, and the mini-buckets of a bucket are
+	// chained over the bucket variable. Messages are passed along the edges
+	// until they stop changing; when no bucket is split the graph is a tree
+	// and the marginals are exact.
+	class JoinGraph {
+	public:
+		JoinGraph(
+			const std::vector<const Variable*> &variables,
+			const std::vector<const Factor*> &factors,
+			std::unordered_map<std::string,bool> &options);
+
+		// sweeps along the bucket order and back, returns the number of sweeps
+		unsigned update(unsigned max, double epsilon);
+
+		Factor marginal(const Variable *v) const;
+
+		unsigned size() const { return _clusters.size(); }
+		unsigned width() const;
+
+		// number of messages computed so far
+		unsigned long updates() const { return _updates; }
+		bool converged() const { return _converged; }
+
+		// maximum number of variables in a cluster
+		static unsigned ibound;
+
+		friend std::ostream &operator<<(std::ostream &os, const JoinGraph &jg);
+
+	private:
+		struct Cluster {
+			std::vector<const Variable*> scope;
+			Factor potential;
+			std::vector<unsigned> edges;   // outgoing edges, edge e^1 is the reverse of e
+		};
+
+		struct Edge {
+			unsigned from;
+			unsigned to;
+			std::vector<const Variable*> eliminated;  // scope of from minus the separator
+			Factor message;
+		};
+
+		std::vector<const Variable*> _variables;
+		std::vector<Cluster> _clusters;
+		std::vector<Edge> _edges;
+		std::vector<int> _home;   // smallest cluster containing each variable
+		bool _log_space;
+		unsigned long _updates;
+		bool _converged;
+
+		void add_edge(unsigned c1, unsigned c2, const std::vector<unsigned> &separator);
+		Factor belief(unsigned c, int except) const;
+		double send(unsigned e);
+	};
+
+}
+
+#endif
@@ -0,0 +1,531 @@
+#include "junction_tree.hh"
+#include "graph.hh"
+#include "thread_pool.hh"
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <utility>
+using namespace std;
+
+namespace bn {
+
+JunctionTree::JunctionTree(
+	const vector<const Variable*> &variables,
+	const vector<const Factor*> &factors,
+	unordered_map<string,bool> &options)
+	: _variables(variables),
+	  _home(variables.size(), -1),
+	  _position(variables.size(), UINT_MAX),
+	  _observers(variables.size()),
+	  _log_space(options["log-space"]),
+	  _updates(0)
+{
+	// only variables in the scope of some factor are in the graph
+	vector<bool> used(_variables.size(), false);
+	for (auto const pf : factors) {
+		const Domain &d = pf->domain();
+		for (unsigned i = 0; i < d.width(); ++i) {
+			used[d[i]->id()] = true;
+		}
+	}
+	vector<const Variable*> graph_variables;
+	for (auto const pv : _variables) {
+		if (used[pv->id()]) {
+			graph_variables.push_back(pv);
+		}
+	}
+
+	Graph g(_variables, factors);
+	unsigned order_width;
+	vector<unsigned> ordering = g.anytime_ordering(graph_variables, order_width, options);
+	for (unsigned k = 0; k < ordering.size(); ++k) {
+		_position[ordering[k]] = k;
+	}
+	vector<vector<unsigned>> cliques = g.elimination_cliques(ordering);
+	unsigned n = cliques.size();
+
+	// elimination tree: each clique hangs from the clique of its
+	// earliest eliminated neighbor
+	vector<int> parent(n, -1);
+	for (unsigned k = 0; k < n; ++k) {
+		unsigned next = UINT_MAX;
+		for (auto id : cliques[k]) {
+			if (id != ordering[k] && _position[id] < next) {
+				next = _position[id];
+			}
+		}
+		if (next != UINT_MAX) {
+			parent[k] = next;
+		}
+	}
+
+	// contract non-maximal cliques into the neighbor that contains them
+	vector<int> redirect(n, -1);
+	auto find = [&redirect](int k) {
+		while (redirect[k] >= 0) k = redirect[k];
+		return k;
+	};
+	for (unsigned k = 0; k < n; ++k) {
+		if (redirect[k] >= 0 || parent[k] < 0) continue;
+		int p = find(parent[k]);
+		if (includes(cliques[p].begin(), cliques[p].end(), cliques[k].begin(), cliques[k].end())) {
+			redirect[k] = p;
+		}
+		else if (includes(cliques[k].begin(), cliques[k].end(), cliques[p].begin(), cliques[p].end())) {
+			redirect[p] = k;
+			parent[k] = parent[p];
+		}
+	}
+
+	vector<int> index(n, -1);
+	for (unsigned k = 0; k < n; ++k) {
+		if (redirect[k] >= 0) continue;
+		vector<const Variable*> scope;
+		for (auto id : cliques[k]) {
+			scope.push_back(_variables[id]);
+		}
+		index[k] = _cliques.size();
+		_cliques.push_back(Clique{ Domain::intern(Domain(scope)), {}, {}, -1, 0, 0 });
+	}
+	for (unsigned k = 0; k < n; ++k) {
+		if (redirect[k] >= 0) continue;
+		unsigned c = index[k];
+		if (parent[k] >= 0) {
+			unsigned p = index[find(parent[k])];
+			_cliques[c].parent = p;
+			_cliques[c].neighbors.push_back(p);
+			_cliques[p].neighbors.push_back(c);
+		}
+		else {
+			_roots.push_back(c);
+		}
+	}
+	if (_cliques.empty()) {
+		_cliques.push_back(Clique{ Domain::intern(Domain()), {}, {}, -1, 0, 0 });
+		_roots.push_back(0);
+	}
+
+	for (unsigned c = 0; c < _cliques.size(); ++c) {
+		const Domain &d = *_cliques[c].domain;
+		for (unsigned i = 0; i < d.width(); ++i) {
+			unsigned id = d[i]->id();
+			if (_home[id] < 0 || d.width() < _cliques[_home[id]].domain->width()) {
+				_home[id] = c;
+			}
+		}
+	}
+
+	// each factor goes to the clique of its earliest eliminated variable
+	for (auto const pf : factors) {
+		const Domain &d = pf->domain();
+		unsigned next = UINT_MAX;
+		for (unsigned i = 0; i < d.width(); ++i) {
+			next = min(next, _position[d[i]->id()]);
+		}
+		unsigned c = (next == UINT_MAX) ? _roots[0] : index[find(next)];
+		_cliques[c].factors.push_back(pf);
+		for (unsigned i = 0; i < d.width(); ++i) {
+			vector<unsigned> &observers = _observers[d[i]->id()];
+			if (observers.empty() || observers.back() != c) {
+				observers.push_back(c);
+			}
+		}
+	}
+
+	// depth and root of each clique, to find paths between cliques
+	for (auto r : _roots) {
+		vector<unsigned> stack(1, r);
+		while (!stack.empty()) {
+			unsigned c = stack.back(); stack.pop_back();
+			for (auto nb : _cliques[c].neighbors) {
+				if ((int) nb == _cliques[c].parent) continue;
+				_cliques[nb].depth = _cliques[c].depth + 1;
+				_cliques[nb].root = r;
+				stack.push_back(nb);
+			}
+		}
+		_cliques[r].root = r;
+	}
+
+	_potentials = vector<Factor>(_cliques.size());
+	for (unsigned c = 0; c < _cliques.size(); ++c) {
+		update_potential(c);
+	}
+
+	_messages.resize(_cliques.size());
+	for (unsigned c = 0; c < _cliques.size(); ++c) {
+		for (auto nb : _cliques[c].neighbors) {
+			_messages[nb][c] = Message{ Factor(1.0), false };
+		}
+	}
+}
+
+void
+JunctionTree::calibrate(const unordered_map<unsigned,unsigned> &evidence)
+{
+	_evidence = evidence;
+
+	TaskGroup group;
+	for (unsigned c = 0; c < _cliques.size(); ++c) {
+		group.run([this, c]() { update_potential(c); });
+	}
+	group.wait();
+
+	for (auto &messages : _messages) {
+		for (auto &it : messages) {
+			it.second.valid = false;
+		}
+	}
+
+	propagate();
+}
+
+// Collect and distribute as a dependency DAG on the thread pool: a clique
+// sends to its parent once all its children have sent to it, and a clique
+// that received from its parent sends to each child in a separate task.
+void
+JunctionTree::propagate()
+{
+	vector<atomic<unsigned>> waiting(_cliques.size());
+	vector<unsigned> leaves;
+	for (unsigned c = 0; c < _cliques.size(); ++c) {
+		unsigned children = _cliques[c].neighbors.size() - (_cliques[c].parent >= 0 ? 1 : 0);
+		waiting[c].store(children);
+		if (children == 0) {
+			leaves.push_back(c);
+		}
+	}
+
+	// dependencies of a message are valid when it is sent, so incoming()
+	// only reads them and threads never recompute the same message
+	atomic<unsigned long> sent(0);
+	auto send = [&](unsigned i, unsigned j) {
+		Message &m = _messages[j][i];
+		if (!m.valid) {
+			m.factor = message(i, j);
+			m.valid = true;
+			sent++;
+		}
+	};
+
+	TaskGroup group;
+	function<void(unsigned)> distribute = [&](unsigned c) {
+		for (auto nb : _cliques[c].neighbors) {
+			if ((int) nb == _cliques[c].parent) continue;
+			group.run([&, c, nb]() {
+				send(c, nb);
+				distribute(nb);
+			});
+		}
+	};
+	function<void(unsigned)> collect = [&](unsigned c) {
+		int p = _cliques[c].parent;
+		if (p < 0) {
+			distribute(c);
+			return;
+		}
+		send(c, p);
+		if (--waiting[p] == 0) {
+			collect(p);
+		}
+	};
+
+	for (auto c : leaves) {
+		group.run([&, c]() { collect(c); });
+	}
+	group.wait();
+
+	_updates += sent;
+}
+
+void
+JunctionTree::observe(unsigned id, unsigned value)
+{
+	auto it = _evidence.find(id);
+	if (it != _evidence.end() && it->second == value) return;
+	_evidence[id] = value;
+
+	for (auto c : _observers[id]) {
+		update_potential(c);
+		for (auto nb : _cliques[c].neighbors) {
+			invalidate(c, nb);
+		}
+	}
+}
+
+void
+JunctionTree::retract(unsigned id)
+{
+	if (!_evidence.erase(id)) return;
+
+	for (auto c : _observers[id]) {
+		update_potential(c);
+		for (auto nb : _cliques[c].neighbors) {
+			invalidate(c, nb);
+		}
+	}
+}
+
+void
+JunctionTree::update_potential(unsigned c)
+{
+	Factor potential = _log_space ? Factor(1.0).log() : Factor(1.0);
+	for (auto const pf : _cliques[c].factors) {
+		Factor f = pf->conditioning(_evidence);
+		if (_log_space) {
+			f = f.log();
+		}
+		potential *= f;
+	}
+	_potentials[c] = move(potential);
+}
+
+void
+JunctionTree::invalidate(unsigned i, unsigned j)
+{
+	// messages past a stale one are already stale
+	Message &m = _messages[j][i];
+	if (!m.valid) return;
+	m.valid = false;
+
+	for (auto k : _cliques[j].neighbors) {
+		if (k != i) {
+			invalidate(j, k);
+		}
+	}
+}
+
+const Factor&
+JunctionTree::incoming(unsigned i, unsigned j) const
+{
+	Message &m = _messages[j][i];
+	if (!m.valid) {
+		m.factor = message(i, j);
+		m.valid = true;
+		_updates++;
+	}
+	return m.factor;
+}
+
+Factor
+JunctionTree::message(unsigned i, unsigned j) const
+{
+	vector<const Factor*> factors(1, &_potentials[i]);
+	for (auto k : _cliques[i].neighbors) {
+		if (k != j) {
+			factors.push_back(&incoming(k, i));
+		}
+	}
+
+	// sum out the variables that are not in the separator
+	const Domain &di = *_cliques[i].domain;
+	const Domain &dj = *_cliques[j].domain;
+	vector<const Variable*> variables;
+	for (unsigned k = 0; k < di.width(); ++k) {
+		if (!dj.in_scope(di[k])) {
+			variables.push_back(di[k]);
+		}
+	}
+
+	return eliminate(factors, variables);
+}
+
+Factor
+JunctionTree::belief(unsigned c) const
+{
+	vector<const Factor*> factors(1, &_potentials[c]);
+	for (auto k : _cliques[c].neighbors) {
+		factors.push_back(&incoming(k, c));
+	}
+	return eliminate(factors, vector<const Variable*>());
+}
+
+Factor
+JunctionTree::eliminate(vector<const Factor*> factors, vector<const Variable*> variables) const
+{
+	sort(variables.begin(), variables.end(), [this](const Variable *v1, const Variable *v2) {
+		return _position[v1->id()] < _position[v2->id()];
+	});
+
+	deque<Factor> intermediate;
+	for (auto const pv : variables) {
+		vector<const Factor*> bucket, rest;
+		for (auto const pf : factors) {
+			if (pf->domain().in_scope(pv)) bucket.push_back(pf);
+			else rest.push_back(pf);
+		}
+		if (bucket.empty()) continue;
+
+		intermediate.push_back(Factor::eliminate(bucket, pv));
+		rest.push_back(&intermediate.back());
+		factors.swap(rest);
+	}
+
+	Factor result = _log_space ? Factor(1.0).log() : Factor(1.0);
+	for (auto const pf : factors) {
+		result *= *pf;
+	}
+	return result;
+}
+
+double
+JunctionTree::partition() const
+{
+	if (_log_space) {
+		return exp(log_partition());
+	}
+
+	double p = 1.0;
+	for (auto r : _roots) {
+		p *= belief(r).partition();
+	}
+	return p;
+}
+
+double
+JunctionTree::log_partition() const
+{
+	double lp = 0.0;
+	for (auto r : _roots) {
+		Factor b = belief(r);
+		lp += b.log_space() ? b.partition() : log(b.partition());
+	}
+	return lp;
+}
+
+Factor
+JunctionTree::marginal(const Variable *v) const
+{
+	unordered_set<const Variable*> variables;
+	variables.insert(v);
+	return joint(variables);
+}
+
+Factor
+JunctionTree::joint(const unordered_set<const Variable*> &variables) const
+{
+	// smallest subtree whose cliques cover the variables: the path from the
+	// home clique of each variable to an anchor clique in the same tree
+	vector<bool> subtree(_cliques.size(), false);
+	unordered_map<unsigned,unsigned> anchor;
+	for (auto const pv : variables) {
+		int h = _home[pv->id()];
+		if (h < 0) continue;
+
+		unsigned a = h, b = h;
+		unsigned r = _cliques[h].root;
+		if (anchor.count(r)) {
+			b = anchor[r];
+		}
+		else {
+			anchor[r] = h;
+		}
+		while (a != b) {
+			if (_cliques[a].depth >= _cliques[b].depth) {
+				subtree[a] = true;
+				a = _cliques[a].parent;
+			}
+			else {
+				subtree[b] = true;
+				b = _cliques[b].parent;
+			}
+		}
+		subtree[a] = true;
+	}
+
+	// potentials of the subtree and the messages entering it
+	vector<const Factor*> factors;
+	unordered_set<const Variable*> scope;
+	for (unsigned c = 0; c < _cliques.size(); ++c) {
+		if (!subtree[c]) continue;
+		factors.push_back(&_potentials[c]);
+		for (auto k : _cliques[c].neighbors) {
+			if (!subtree[k]) {
+				factors.push_back(&incoming(k, c));
+			}
+		}
+		const Domain &d = *_cliques[c].domain;
+		for (unsigned i = 0; i < d.width(); ++i) {
+			if (!variables.count(d[i])) {
+				scope.insert(d[i]);
+			}
+		}
+	}
+
+	Factor f = eliminate(factors, vector<const Variable*>(scope.begin(), scope.end())).normalize();
+	return f.exp();
+}
+
+Factor
+JunctionTree::query(
+	const unordered_set<const Variable*> &target,
+	const unordered_set<const Variable*> &evidence) const
+{
+	// observed variables are already conditioned in the potentials, so they
+	// are left out of the joint and put back as point masses on their values
+	unordered_set<const Variable*> free_target, free_evidence;
+	vector<const Variable*> observed;
+	for (auto const vars : { &target, &evidence }) {
+		for (auto const pv : *vars) {
+			if (_evidence.count(pv->id())) {
+				observed.push_back(pv);
+			}
+			else if (vars == &target) {
+				free_target.insert(pv);
+			}
+			else {
+				free_evidence.insert(pv);
+			}
+		}
+	}
+
+	unordered_set<const Variable*> variables(free_target);
+	variables.insert(free_evidence.begin(), free_evidence.end());
+
+	Factor f = joint(variables);
+	if (!free_evidence.empty()) {
+		Factor g = f;
+		for (auto pv : free_target) {
+			g = g.sum_out(pv);
+		}
+		f = f.divide(g);
+	}
+
+	for (auto const pv : observed) {
+		vector<double> values(pv->size(), 0.0);
+		values[_evidence.at(pv->id())] = 1.0;
+		Factor point(Domain::intern(Domain(vector<const Variable*>(1, pv))), values, 1.0);
+		f *= f.log_space() ? point.log() : point;
+	}
+	return f;
+}
+
+unsigned
+JunctionTree::width() const
+{
+	unsigned width = 0;
+	for (auto const &c : _cliques) {
+		if (c.domain->width() > width + 1) {
+			width = c.domain->width() - 1;
+		}
+	}
+	return width;
+}
+
+ostream&
+operator<<(ostream &os, const JunctionTree &jt)
+{
+	os << "JunctionTree(";
+	os << "cliques:" << jt.size() << ", ";
+	os << "trees:" << jt._roots.size() << ", ";
+	os << "width:" << jt.width() << ", ";
+	os << "messages:" << jt._updates << ")";
+	return os;
+}
+
+}
@@ -0,0 +1,91 @@
+#ifndef _BN_JUNCTION_TREE_H_
+#define _BN_JUNCTION_TREE_H_
+
+#include "variable.hh"
+#include "factor.hh"
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace bn {
+
+	// Clique tree compiled from an elimination ordering of the model graph.
+	// Calibration runs one collect and one distribute pass of Shenoy-Shafer
+	// messages on the thread pool, after which every marginal is read from
+	// a single clique.
+	// Messages are cached: evidence changes only invalidate the messages
+	// leaving the affected cliques, which are recomputed when next needed.
+	class JunctionTree {
+	public:
+		JunctionTree(
+			const std::vector<const Variable*> &variables,
+			const std::vector<const Factor*> &factors,
+			std::unordered_map<std::string,bool> &options);
+
+		void calibrate(const std::unordered_map<unsigned,unsigned> &evidence);
+
+		void observe(unsigned id, unsigned value);
+		void retract(unsigned id);
+		const std::unordered_map<unsigned,unsigned> &evidence() const { return _evidence; }
+
+		double partition() const;
+		double log_partition() const;
+
+		Factor marginal(const Variable *v) const;
+		Factor joint(const std::unordered_set<const Variable*> &variables) const;
+		Factor query(
+			const std::unordered_set<const Variable*> &target,
+			const std::unordered_set<const Variable*> &evidence) const;
+
+		unsigned size()  const { return _cliques.size(); }
+		unsigned width() const;
+
+		// number of messages computed so far
+		unsigned long updates() const { return _updates; }
+
+		friend std::ostream &operator<<(std::ostream &os, const JunctionTree &jt);
+
+	private:
+		struct Message {
+			Factor factor;
+			bool valid;
+		};
+
+		struct Clique {
+			std::shared_ptr<const Domain> domain;
+			std::vector<unsigned> neighbors;
+			std::vector<const Factor*> factors;
+			int parent;
+			unsigned depth;
+			unsigned root;
+		};
+
+		std::vector<const Variable*> _variables;
+		std::vector<Clique> _cliques;
+		std::vector<int> _home;            // smallest clique containing each variable
+		std::vector<unsigned> _position;   // position of each variable in the elimination ordering
+		std::vector<unsigned> _roots;
+		std::vector<std::vector<unsigned>> _observers;  // cliques with a factor over each variable
+		bool _log_space;
+
+		std::unordered_map<unsigned,unsigned> _evidence;
+		std::vector<Factor> _potentials;
+		mutable std::vector<std::unordered_map<unsigned,Message>> _messages;  // _messages[j][i] = message from i to j
+		mutable unsigned long _updates;
+
+		void propagate();
+		void update_potential(unsigned c);
+		void invalidate(unsigned i, unsigned j);
+		const Factor &incoming(unsigned i, unsigned j) const;
+		Factor message(unsigned i, unsigned j) const;
+		Factor belief(unsigned c) const;
+		Factor eliminate(std::vector<const Factor*> factors, std::vector<const Variable*> variables) const;
+	};
+
+}
+
+#endif
@@ -0,0 +1,758 @@
+#include "kernels.hh"
+
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BN_KERNELS_X86 1
+// silence false positives on _mm*_undefined_pd() inside the AVX-512 headers
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#endif
+
+namespace bn {
+
+namespace kernels {
+
+struct Dispatch {
+    const char *isa;
+    double (*sum)(const double *x, unsigned n);
+    double (*max)(const double *x, unsigned n);
+    double (*min)(const double *x, unsigned n);
+    void (*scale)(double *x, unsigned n, double alpha);
+    void (*shift)(double *x, unsigned n, double alpha);
+    void (*exp)(double *x, unsigned n);
+    double (*logsumexp)(const double *x, unsigned n);
+    double (*sum_axis)(const double *x, double *y, unsigned outer, unsigned card, unsigned inner);
+    double (*logsumexp_axis)(const double *x, double *y, unsigned outer, unsigned card, unsigned inner);
+};
+
+/* scalar fallback */
+
+static double
+sum_scalar(const double *x, unsigned n)
+{
+    double s = 0.0;
+    for (unsigned i = 0; i < n; ++i) {
+        s += x[i];
+    }
+    return s;
+}
+
+static double
+max_scalar(const double *x, unsigned n)
+{
+    double m = -HUGE_VAL;
+    for (unsigned i = 0; i < n; ++i) {
+        if (x[i] > m) m = x[i];
+    }
+    return m;
+}
+
+static double
+min_scalar(const double *x, unsigned n)
+{
+    double m = HUGE_VAL;
+    for (unsigned i = 0; i < n; ++i) {
+        if (x[i] < m) m = x[i];
+    }
+    return m;
+}
+
+static void
+scale_scalar(double *x, unsigned n, double alpha)
+{
+    for (unsigned i = 0; i < n; ++i) {
+        x[i] *= alpha;
+    }
+}
+
+static double
+sum_axis_scalar(const double *x, double *y, unsigned outer, unsigned card, unsigned inner)
+{
+    for (unsigned o = 0; o < outer; ++o) {
+        const double *xo = x + o * card * inner;
+        double *yo = y + o * inner;
+        for (unsigned i = 0; i < inner; ++i) {
+            yo[i] = xo[i];
+        }
+        for (unsigned v = 1; v < card; ++v) {
+            const double *xv = xo + v * inner;
+            for (unsigned i = 0; i < inner; ++i) {
+                yo[i] += xv[i];
+            }
+        }
+    }
+    return sum_scalar(y, outer * inner);
+}
+
+static void
+shift_scalar(double *x, unsigned n, double alpha)
+{
+    for (unsigned i = 0; i < n; ++i) {
+        x[i] += alpha;
+    }
+}
+
+static void
+exp_scalar(double *x, unsigned n)
+{
+    for (unsigned i = 0; i < n; ++i) {
+        x[i] = std::exp(x[i]);
+    }
+}
+
+static inline double
+logsumexp_strided(const double *x, unsigned n, unsigned stride)
+{
+    double m = -HUGE_VAL;
+    for (unsigned i = 0; i < n; ++i) {
+        if (x[i * stride] > m) m = x[i * stride];
+    }
+    if (m == -HUGE_VAL) return m;
+    double s = 0.0;
+    for (unsigned i = 0; i < n; ++i) {
+        s += std::exp(x[i * stride] - m);
+    }
+    return m + std::log(s);
+}
+
+static double
+logsumexp_scalar(const double *x, unsigned n)
+{
+    return logsumexp_strided(x, n, 1);
+}
+
+static double
+logsumexp_axis_scalar(const double *x, double *y, unsigned outer, unsigned card, unsigned inner)
+{
+    for (unsigned o = 0; o < outer; ++o) {
+        const double *xo = x + o * card * inner;
+        double *yo = y + o * inner;
+        for (unsigned i = 0; i < inner; ++i) {
+            yo[i] = logsumexp_strided(xo + i, card, inner);
+        }
+    }
+    return logsumexp_scalar(y, outer * inner);
+}
+
+#ifdef BN_KERNELS_X86
+
+/* AVX2 */
+
+__attribute__((target("avx2"))) static inline double
+hsum_avx2(__m256d v)
+{
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    hi = _mm_unpackhi_pd(lo, lo);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, hi));
+}
+
+__attribute__((target("avx2"))) static double
+sum_avx2(const double *x, unsigned n)
+{
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(x + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(x + i + 4));
+    }
+    acc0 = _mm256_add_pd(acc0, acc1);
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(x + i));
+    }
+    double s = hsum_avx2(acc0);
+    for (; i < n; ++i) {
+        s += x[i];
+    }
+    return s;
+}
+
+__attribute__((target("avx2"))) static double
+max_avx2(const double *x, unsigned n)
+{
+    __m256d acc = _mm256_set1_pd(-HUGE_VAL);
+    unsigned i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_max_pd(acc, _mm256_loadu_pd(x + i));
+    }
+    double buf[4];
+    _mm256_storeu_pd(buf, acc);
+    double m = buf[0];
+    for (unsigned j = 1; j < 4; ++j) {
+        if (buf[j] > m) m = buf[j];
+    }
+    for (; i < n; ++i) {
+        if (x[i] > m) m = x[i];
+    }
+    return m;
+}
+
+__attribute__((target("avx2"))) static double
+min_avx2(const double *x, unsigned n)
+{
+    __m256d acc = _mm256_set1_pd(HUGE_VAL);
+    unsigned i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_min_pd(acc, _mm256_loadu_pd(x + i));
+    }
+    double buf[4];
+    _mm256_storeu_pd(buf, acc);
+    double m = buf[0];
+    for (unsigned j = 1; j < 4; ++j) {
+        if (buf[j] < m) m = buf[j];
+    }
+    for (; i < n; ++i) {
+        if (x[i] < m) m = x[i];
+    }
+    return m;
+}
+
+__attribute__((target("avx2"))) static void
+scale_avx2(double *x, unsigned n, double alpha)
+{
+    __m256d a = _mm256_set1_pd(alpha);
+    unsigned i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(x + i, _mm256_mul_pd(a, _mm256_loadu_pd(x + i)));
+    }
+    for (; i < n; ++i) {
+        x[i] *= alpha;
+    }
+}
+
+__attribute__((target("avx2"))) static double
+sum_axis_avx2(const double *x, double *y, unsigned outer, unsigned card, unsigned inner)
+{
+    if (inner == 1 && card == 2) {
+        // pairwise horizontal adds of 8 consecutive values give 4 outputs
+        unsigned o = 0;
+        for (; o + 4 <= outer; o += 4) {
+            __m256d a = _mm256_loadu_pd(x + 2*o);
+            __m256d b = _mm256_loadu_pd(x + 2*o + 4);
+            __m256d h = _mm256_hadd_pd(a, b);
+            _mm256_storeu_pd(y + o, _mm256_permute4x64_pd(h, 0xD8));
+        }
+        for (; o < outer; ++o) {
+            y[o] = x[2*o] + x[2*o + 1];
+        }
+    }
+    else if (inner == 1) {
+        for (unsigned o = 0; o < outer; ++o) {
+            y[o] = sum_avx2(x + o * card, card);
+        }
+    }
+    else if (inner >= 4) {
+        for (unsigned o = 0; o < outer; ++o) {
+            const double *xo = x + o * card * inner;
+            double *yo = y + o * inner;
+            unsigned i = 0;
+            for (; i + 8 <= inner; i += 8) {
+                __m256d acc0 = _mm256_loadu_pd(xo + i);
+                __m256d acc1 = _mm256_loadu_pd(xo + i + 4);
+                for (unsigned v = 1; v < card; ++v) {
+                    const double *xv = xo + v * inner + i;
+                    acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(xv));
+                    acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(xv + 4));
+                }
+                _mm256_storeu_pd(yo + i, acc0);
+                _mm256_storeu_pd(yo + i + 4, acc1);
+            }
+            for (; i + 4 <= inner; i += 4) {
+                __m256d acc = _mm256_loadu_pd(xo + i);
+                for (unsigned v = 1; v < card; ++v) {
+                    acc = _mm256_add_pd(acc, _mm256_loadu_pd(xo + v * inner + i));
+                }
+                _mm256_storeu_pd(yo + i, acc);
+            }
+            for (; i < inner; ++i) {
+                double s = xo[i];
+                for (unsigned v = 1; v < card; ++v) {
+                    s += xo[v * inner + i];
+                }
+                yo[i] = s;
+            }
+        }
+    }
+    else {
+        return sum_axis_scalar(x, y, outer, card, inner);
+    }
+    return sum_avx2(y, outer * inner);
+}
+
+// exp(x) = 2^n * exp(r), with n = round(x / ln 2) and |r| <= ln(2) / 2,
+// exp(r) by its Taylor polynomial of degree 13 (relative error < 1e-16)
+static const double EXP_LN2_HI = 0.693145751953125;
+static const double EXP_LN2_LO = 1.42860682030941723212e-6;
+static const double EXP_LOG2E = 1.4426950408889634074;
+static const double EXP_MIN = -708.39641853226410622;  // log(DBL_MIN)
+static const double EXP_MAX = 709.78271289338399678;   // log(DBL_MAX)
+static const double EXP_COEFFICIENTS[] = {
+    1.0 / 6227020800.0, 1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0,
+    1.0 / 362880.0, 1.0 / 40320.0, 1.0 / 5040.0, 1.0 / 720.0,
+    1.0 / 120.0, 1.0 / 24.0, 1.0 / 6.0, 1.0 / 2.0, 1.0, 1.0
+};
+
+__attribute__((target("avx2"))) static inline __m256d
+exp_pd_avx2(__m256d x)
+{
+    __m256d underflow = _mm256_cmp_pd(x, _mm256_set1_pd(EXP_MIN), _CMP_LT_OQ);
+    __m256d overflow = _mm256_cmp_pd(x, _mm256_set1_pd(EXP_MAX), _CMP_GT_OQ);
+    x = _mm256_max_pd(x, _mm256_set1_pd(EXP_MIN));
+    x = _mm256_min_pd(x, _mm256_set1_pd(EXP_MAX));
+
+    __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_sub_pd(x, _mm256_mul_pd(n, _mm256_set1_pd(EXP_LN2_HI)));
+    r = _mm256_sub_pd(r, _mm256_mul_pd(n, _mm256_set1_pd(EXP_LN2_LO)));
+
+    __m256d p = _mm256_set1_pd(EXP_COEFFICIENTS[0]);
+    for (unsigned k = 1; k < 14; ++k) {
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(EXP_COEFFICIENTS[k]));
+    }
+
+    // 2^n built from the exponent bits in two halves, n reaches 1024 near EXP_MAX
+    __m256d n1 = _mm256_floor_pd(_mm256_mul_pd(n, _mm256_set1_pd(0.5)));
+    __m256d n2 = _mm256_sub_pd(n, n1);
+    __m256i e1 = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n1));
+    __m256i e2 = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n2));
+    e1 = _mm256_slli_epi64(_mm256_add_epi64(e1, _mm256_set1_epi64x(1023)), 52);
+    e2 = _mm256_slli_epi64(_mm256_add_epi64(e2, _mm256_set1_epi64x(1023)), 52);
+    p = _mm256_mul_pd(_mm256_mul_pd(p, _mm256_castsi256_pd(e1)), _mm256_castsi256_pd(e2));
+
+    p = _mm256_andnot_pd(underflow, p);
+    return _mm256_blendv_pd(p, _mm256_set1_pd(HUGE_VAL), overflow);
+}
+
+__attribute__((target("avx2"))) static void
+shift_avx2(double *x, unsigned n, double alpha)
+{
+    __m256d a = _mm256_set1_pd(alpha);
+    unsigned i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(x + i, _mm256_add_pd(a, _mm256_loadu_pd(x + i)));
+    }
+    for (; i < n; ++i) {
+        x[i] += alpha;
+    }
+}
+
+__attribute__((target("avx2"))) static void
+exp_avx2(double *x, unsigned n)
+{
+    unsigned i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(x + i, exp_pd_avx2(_mm256_loadu_pd(x + i)));
+    }
+    for (; i < n; ++i) {
+        x[i] = std::exp(x[i]);
+    }
+}
+
+__attribute__((target("avx2"))) static double
+logsumexp_avx2(const double *x, unsigned n)
+{
+    double m = max_avx2(x, n);
+    if (m == -HUGE_VAL) return m;
+    __m256d vm = _mm256_set1_pd(m);
+    __m256d acc = _mm256_setzero_pd();
+    unsigned i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_add_pd(acc, exp_pd_avx2(_mm256_sub_pd(_mm256_loadu_pd(x + i), vm)));
+    }
+    double s = hsum_avx2(acc);
+    for (; i < n; ++i) {
+        s += std::exp(x[i] - m);
+    }
+    return m + std::log(s);
+}
+
+// y = m + log(s) lane by lane, where lanes with m = -inf have s = 0
+__attribute__((target("avx2"))) static inline void
+store_log_avx2(double *y, __m256d m, __m256d s)
+{
+    double bm[4], bs[4];
+    _mm256_storeu_pd(bm, m);
+    _mm256_storeu_pd(bs, s);
+    for (unsigned j = 0; j < 4; ++j) {
+        y[j] = bm[j] + std::log(bs[j]);
+    }
+}
+
+__attribute__((target("avx2"))) static double
+logsumexp_axis_avx2(const double *x, double *y, unsigned outer, unsigned card, unsigned inner)
+{
+    const __m256d lowest = _mm256_set1_pd(-HUGE_VAL);
+    if (inner == 1) {
+        // gather 4 consecutive outputs, card values apart
+        unsigned o = 0;
+        __m128i index = _mm_setr_epi32(0, card, 2*card, 3*card);
+        for (; o + 4 <= outer; o += 4) {
+            const double *xo = x + o * card;
+            __m256d m = lowest;
+            for (unsigned v = 0; v < card; ++v) {
+                m = _mm256_max_pd(m, _mm256_i32gather_pd(xo + v, index, 8));
+            }
+            m = _mm256_andnot_pd(_mm256_cmp_pd(m, lowest, _CMP_EQ_OQ), m);
+            __m256d s = _mm256_setzero_pd();
+            for (unsigned v = 0; v < card; ++v) {
+                s = _mm256_add_pd(s, exp_pd_avx2(_mm256_sub_pd(_mm256_i32gather_pd(xo + v, index, 8), m)));
+            }
+            store_log_avx2(y + o, m, s);
+        }
+        for (; o < outer; ++o) {
+            y[o] = logsumexp_avx2(x + o * card, card);
+        }
+    }
+    else if (inner >= 4) {
+        for (unsigned o = 0; o < outer; ++o) {
+            const double *xo = x + o * card * inner;
+            double *yo = y + o * inner;
+            unsigned i = 0;
+            for (; i + 4 <= inner; i += 4) {
+                __m256d m = lowest;
+                for (unsigned v = 0; v < card; ++v) {
+                    m = _mm256_max_pd(m, _mm256_loadu_pd(xo + v * inner + i));
+                }
+                m = _mm256_andnot_pd(_mm256_cmp_pd(m, lowest, _CMP_EQ_OQ), m);
+                __m256d s = _mm256_setzero_pd();
+                for (unsigned v = 0; v < card; ++v) {
+                    s = _mm256_add_pd(s, exp_pd_avx2(_mm256_sub_pd(_mm256_loadu_pd(xo + v * inner + i), m)));
+                }
+                store_log_avx2(yo + i, m, s);
+            }
+            for (; i < inner; ++i) {
+                yo[i] = logsumexp_strided(xo + i, card, inner);
+            }
+        }
+    }
+    else {
+        return logsumexp_axis_scalar(x, y, outer, card, inner);
+    }
+    return logsumexp_avx2(y, outer * inner);
+}
+
+/* AVX-512 */
+
+__attribute__((target("avx512f"))) static inline __mmask8
+tail_mask_avx512(unsigned n)
+{
+    return (__mmask8) ((1u << n) - 1);
+}
+
+__attribute__((target("avx512f"))) static double
+sum_avx512(const double *x, unsigned n)
+{
+    __m512d acc0 = _mm512_setzero_pd();
+    __m512d acc1 = _mm512_setzero_pd();
+    unsigned i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_add_pd(acc0, _mm512_loadu_pd(x + i));
+        acc1 = _mm512_add_pd(acc1, _mm512_loadu_pd(x + i + 8));
+    }
+    acc0 = _mm512_add_pd(acc0, acc1);
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm512_add_pd(acc0, _mm512_loadu_pd(x + i));
+    }
+    if (i < n) {
+        acc0 = _mm512_add_pd(acc0, _mm512_maskz_loadu_pd(tail_mask_avx512(n - i), x + i));
+    }
+    return _mm512_reduce_add_pd(acc0);
+}
+
+__attribute__((target("avx512f"))) static double
+max_avx512(const double *x, unsigned n)
+{
+    __m512d lowest = _mm512_set1_pd(-HUGE_VAL);
+    __m512d acc = lowest;
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm512_max_pd(acc, _mm512_loadu_pd(x + i));
+    }
+    if (i < n) {
+        acc = _mm512_max_pd(acc, _mm512_mask_loadu_pd(lowest, tail_mask_avx512(n - i), x + i));
+    }
+    return _mm512_reduce_max_pd(acc);
+}
+
+__attribute__((target("avx512f"))) static double
+min_avx512(const double *x, unsigned n)
+{
+    __m512d highest = _mm512_set1_pd(HUGE_VAL);
+    __m512d acc = highest;
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm512_min_pd(acc, _mm512_loadu_pd(x + i));
+    }
+    if (i < n) {
+        acc = _mm512_min_pd(acc, _mm512_mask_loadu_pd(highest, tail_mask_avx512(n - i), x + i));
+    }
+    return _mm512_reduce_min_pd(acc);
+}
+
+__attribute__((target("avx512f"))) static void
+scale_avx512(double *x, unsigned n, double alpha)
+{
+    __m512d a = _mm512_set1_pd(alpha);
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_pd(x + i, _mm512_mul_pd(a, _mm512_loadu_pd(x + i)));
+    }
+    if (i < n) {
+        __mmask8 mask = tail_mask_avx512(n - i);
+        _mm512_mask_storeu_pd(x + i, mask, _mm512_mul_pd(a, _mm512_maskz_loadu_pd(mask, x + i)));
+    }
+}
+
+__attribute__((target("avx512f"))) static double
+sum_axis_avx512(const double *x, double *y, unsigned outer, unsigned card, unsigned inner)
+{
+    if (inner == 1 && card == 2) {
+        sum_axis_avx2(x, y, outer, card, inner);
+    }
+    else if (inner == 1) {
+        for (unsigned o = 0; o < outer; ++o) {
+            y[o] = sum_avx512(x + o * card, card);
+        }
+    }
+    else {
+        for (unsigned o = 0; o < outer; ++o) {
+            const double *xo = x + o * card * inner;
+            double *yo = y + o * inner;
+            unsigned i = 0;
+            for (; i + 8 <= inner; i += 8) {
+                __m512d acc = _mm512_loadu_pd(xo + i);
+                for (unsigned v = 1; v < card; ++v) {
+                    acc = _mm512_add_pd(acc, _mm512_loadu_pd(xo + v * inner + i));
+                }
+                _mm512_storeu_pd(yo + i, acc);
+            }
+            if (i < inner) {
+                __mmask8 mask = tail_mask_avx512(inner - i);
+                __m512d acc = _mm512_maskz_loadu_pd(mask, xo + i);
+                for (unsigned v = 1; v < card; ++v) {
+                    acc = _mm512_add_pd(acc, _mm512_maskz_loadu_pd(mask, xo + v * inner + i));
+                }
+                _mm512_mask_storeu_pd(yo + i, mask, acc);
+            }
+        }
+    }
+    return sum_avx512(y, outer * inner);
+}
+
+__attribute__((target("avx512f"))) static inline __m512d
+exp_pd_avx512(__m512d x)
+{
+    // scalef takes care of overflow and gradual underflow
+    x = _mm512_max_pd(x, _mm512_set1_pd(-750.0));
+    x = _mm512_min_pd(x, _mm512_set1_pd(710.0));
+
+    __m512d n = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512d r = _mm512_sub_pd(x, _mm512_mul_pd(n, _mm512_set1_pd(EXP_LN2_HI)));
+    r = _mm512_sub_pd(r, _mm512_mul_pd(n, _mm512_set1_pd(EXP_LN2_LO)));
+
+    __m512d p = _mm512_set1_pd(EXP_COEFFICIENTS[0]);
+    for (unsigned k = 1; k < 14; ++k) {
+        p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(EXP_COEFFICIENTS[k]));
+    }
+    return _mm512_scalef_pd(p, n);
+}
+
+__attribute__((target("avx512f"))) static void
+shift_avx512(double *x, unsigned n, double alpha)
+{
+    __m512d a = _mm512_set1_pd(alpha);
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_pd(x + i, _mm512_add_pd(a, _mm512_loadu_pd(x + i)));
+    }
+    if (i < n) {
+        __mmask8 mask = tail_mask_avx512(n - i);
+        _mm512_mask_storeu_pd(x + i, mask, _mm512_add_pd(a, _mm512_maskz_loadu_pd(mask, x + i)));
+    }
+}
+
+__attribute__((target("avx512f"))) static void
+exp_avx512(double *x, unsigned n)
+{
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_pd(x + i, exp_pd_avx512(_mm512_loadu_pd(x + i)));
+    }
+    if (i < n) {
+        __mmask8 mask = tail_mask_avx512(n - i);
+        _mm512_mask_storeu_pd(x + i, mask, exp_pd_avx512(_mm512_maskz_loadu_pd(mask, x + i)));
+    }
+}
+
+__attribute__((target("avx512f"))) static double
+logsumexp_avx512(const double *x, unsigned n)
+{
+    double m = max_avx512(x, n);
+    if (m == -HUGE_VAL) return m;
+    __m512d lowest = _mm512_set1_pd(-HUGE_VAL);
+    __m512d vm = _mm512_set1_pd(m);
+    __m512d acc = _mm512_setzero_pd();
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm512_add_pd(acc, exp_pd_avx512(_mm512_sub_pd(_mm512_loadu_pd(x + i), vm)));
+    }
+    if (i < n) {
+        __m512d t = _mm512_mask_loadu_pd(lowest, tail_mask_avx512(n - i), x + i);
+        acc = _mm512_add_pd(acc, exp_pd_avx512(_mm512_sub_pd(t, vm)));
+    }
+    return m + std::log(_mm512_reduce_add_pd(acc));
+}
+
+// y[j] = m[j] + log(s[j]) for the first n lanes, where lanes with m = -inf have s = 0
+__attribute__((target("avx512f"))) static inline void
+store_log_avx512(double *y, __m512d m, __m512d s, unsigned n)
+{
+    double bm[8], bs[8];
+    _mm512_storeu_pd(bm, m);
+    _mm512_storeu_pd(bs, s);
+    for (unsigned j = 0; j < n; ++j) {
+        y[j] = bm[j] + std::log(bs[j]);
+    }
+}
+
+__attribute__((target("avx512f"))) static double
+logsumexp_axis_avx512(const double *x, double *y, unsigned outer, unsigned card, unsigned inner)
+{
+    const __m512d lowest = _mm512_set1_pd(-HUGE_VAL);
+    if (inner == 1) {
+        // gather 8 consecutive outputs, card values apart
+        unsigned o = 0;
+        __m256i index = _mm256_setr_epi32(0, card, 2*card, 3*card, 4*card, 5*card, 6*card, 7*card);
+        for (; o + 8 <= outer; o += 8) {
+            const double *xo = x + o * card;
+            __m512d m = lowest;
+            for (unsigned v = 0; v < card; ++v) {
+                m = _mm512_max_pd(m, _mm512_i32gather_pd(index, xo + v, 8));
+            }
+            m = _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(m, lowest, _CMP_NEQ_OQ), m);
+            __m512d s = _mm512_setzero_pd();
+            for (unsigned v = 0; v < card; ++v) {
+                s = _mm512_add_pd(s, exp_pd_avx512(_mm512_sub_pd(_mm512_i32gather_pd(index, xo + v, 8), m)));
+            }
+            store_log_avx512(y + o, m, s, 8);
+        }
+        for (; o < outer; ++o) {
+            y[o] = logsumexp_avx512(x + o * card, card);
+        }
+    }
+    else {
+        for (unsigned o = 0; o < outer; ++o) {
+            const double *xo = x + o * card * inner;
+            double *yo = y + o * inner;
+            for (unsigned i = 0; i < inner; i += 8) {
+                unsigned count = (inner - i < 8) ? inner - i : 8;
+                __mmask8 mask = tail_mask_avx512(count);
+                __m512d m = lowest;
+                for (unsigned v = 0; v < card; ++v) {
+                    m = _mm512_max_pd(m, _mm512_mask_loadu_pd(lowest, mask, xo + v * inner + i));
+                }
+                m = _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(m, lowest, _CMP_NEQ_OQ), m);
+                __m512d s = _mm512_setzero_pd();
+                for (unsigned v = 0; v < card; ++v) {
+                    __m512d t = _mm512_mask_loadu_pd(lowest, mask, xo + v * inner + i);
+                    s = _mm512_add_pd(s, exp_pd_avx512(_mm512_sub_pd(t, m)));
+                }
+                store_log_avx512(yo + i, m, s, count);
+            }
+        }
+    }
+    return logsumexp_avx512(y, outer * inner);
+}
+
+#endif
+
+static Dispatch
+select_kernels()
+{
+#ifdef BN_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return Dispatch{ "avx512", sum_avx512, max_avx512, min_avx512, scale_avx512, shift_avx512, exp_avx512, logsumexp_avx512, sum_axis_avx512, logsumexp_axis_avx512 };
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return Dispatch{ "avx2", sum_avx2, max_avx2, min_avx2, scale_avx2, shift_avx2, exp_avx2, logsumexp_avx2, sum_axis_avx2, logsumexp_axis_avx2 };
+    }
+#endif
+    return Dispatch{ "scalar", sum_scalar, max_scalar, min_scalar, scale_scalar, shift_scalar, exp_scalar, logsumexp_scalar, sum_axis_scalar, logsumexp_axis_scalar };
+}
+
+static const Dispatch&
+dispatch()
+{
+    static const Dispatch kernels = select_kernels();
+    return kernels;
+}
+
+const char*
+isa()
+{
+    return dispatch().isa;
+}
+
+double
+sum(const double *x, unsigned n)
+{
+    return dispatch().sum(x, n);
+}
+
+double
+max(const double *x, unsigned n)
+{
+    return dispatch().max(x, n);
+}
+
+double
+min(const double *x, unsigned n)
+{
+    return dispatch().min(x, n);
+}
+
+void
+scale(double *x, unsigned n, double alpha)
+{
+    dispatch().scale(x, n, alpha);
+}
+
+void
+shift(double *x, unsigned n, double alpha)
+{
+    dispatch().shift(x, n, alpha);
+}
+
+void
+exp(double *x, unsigned n)
+{
+    dispatch().exp(x, n);
+}
+
+double
+logsumexp(const double *x, unsigned n)
+{
+    return dispatch().logsumexp(x, n);
+}
+
+double
+sum_axis(const double *x, double *y, unsigned outer, unsigned card, unsigned inner)
+{
+    return dispatch().sum_axis(x, y, outer, card, inner);
+}
+
+double
+logsumexp_axis(const double *x, double *y, unsigned outer, unsigned card, unsigned inner)
+{
+    return dispatch().logsumexp_axis(x, y, outer, card, inner);
+}
+
+}
+
+}
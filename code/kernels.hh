@@ -0,0 +1,40 @@
+#ifndef _BN_KERNELS_H_
+#define _BN_KERNELS_H_
+
+namespace bn {
+
+namespace kernels {
+
+// Name of the instruction set selected at runtime ("avx512", "avx2" or "scalar").
+const char *isa();
+
+double sum(const double *x, unsigned n);
+double max(const double *x, unsigned n);
+double min(const double *x, unsigned n);
+
+// x[i] *= alpha
+void scale(double *x, unsigned n, double alpha);
+
+// x[i] += alpha
+void shift(double *x, unsigned n, double alpha);
+
+// x[i] = exp(x[i])
+void exp(double *x, unsigned n);
+
+// log(sum_i exp(x[i])), -inf if all x[i] are -inf
+double logsumexp(const double *x, unsigned n);
+
+// Sum out the middle axis of the row-major array x[outer][card][inner]
+// into y[outer][inner]. Returns the sum of all entries of y.
+// inner == 1 sums out the innermost axis and outer == 1 the outermost one.
+double sum_axis(const double *x, double *y, unsigned outer, unsigned card, unsigned inner);
+
+// Log-space version of sum_axis: y[o][i] = logsumexp_v x[o][v][i].
+// Returns the logsumexp of all entries of y.
+double logsumexp_axis(const double *x, double *y, unsigned outer, unsigned card, unsigned inner);
+
+}
+
+}
+
+#endif
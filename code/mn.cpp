@@ -1,4 +1,6 @@
 #include "io.hh"
+#include "join_graph.hh"
+#include "thread_pool.hh"
 using namespace bn;
 
 #include <iostream>
@@ -71,6 +73,22 @@ usage(const char *progname)
 {
 	cout << "usage: " << progname << " /path/to/model.uai /path/to/evidence.uai.evid [OPTIONS]" << endl << endl;
 	cout << "OPTIONS:" << endl;
+	cout << "-ve\tcompute inference using variable elimination" << endl;
+	cout << "-mf\tvariable elimination using min-fill heuristic" << endl;
+	cout << "-wmf\tvariable elimination using weighted min-fill heuristic" << endl;
+	cout << "-md\tvariable elimination using min-degree heuristic" << endl;
+	cout << "-sp\tcompute inference using sum-product in factor graphs (Bethe estimate of the partition function)" << endl;
+	cout << "-rbp\tsum-product with residual belief propagation" << endl;
+	cout << "-bp-messages N\tstop residual belief propagation after N message updates" << endl;
+	cout << "-bp-time MS\tstop residual belief propagation after MS milliseconds" << endl;
+	cout << "-jt\tcompute inference using a junction tree" << endl;
+	cout << "-joint\tcompute inference on the joint distribution (small models only)" << endl;
+	cout << "-ijgp\tcompute marginals using iterative join-graph propagation" << endl;
+	cout << "-ibound N\tlimit join-graph clusters to N variables (default 8)" << endl;
+	cout << "-log\tcompute factors in log space" << endl;
+	cout << "-threads N\trun inference on N threads (0 uses all cores)" << endl;
+	cout << "-parallel-min N\tsplit factor operations with at least N entries across threads" << endl;
+	cout << "-order-budget MS\tsearch elimination orderings for MS milliseconds" << endl;
 	cout << "-h\tdisplay help information" << endl;
 	cout << "-v\tverbose" << endl;
 }
@@ -79,6 +97,16 @@ void
 read_options(int argc, char *argv[])
 {
 	// default options
+	options["variable-elimination"] = false;
+	options["min-fill"] = false;
+	options["weighted-min-fill"] = false;
+	options["min-degree"] = false;
+	options["sum-product"] = false;
+	options["residual-bp"] = false;
+	options["junction-tree"] = false;
+	options["join-graph"] = false;
+	options["joint"] = false;
+	options["log-space"] = false;
 	options["verbose"] = false;
 	options["help"] = false;
 
@@ -90,6 +118,55 @@ read_options(int argc, char *argv[])
 		else if (option == "-v") {
 			options["verbose"] = true;
 		}
+		else if (option == "-ve") {
+			options["variable-elimination"] = true;
+		}
+		else if (option == "-mf") {
+			options["min-fill"] = true;
+		}
+		else if (option == "-wmf") {
+			options["weighted-min-fill"] = true;
+		}
+		else if (option == "-md") {
+			options["min-degree"] = true;
+		}
+		else if (option == "-sp") {
+			options["sum-product"] = true;
+		}
+		else if (option == "-rbp") {
+			options["sum-product"] = true;
+			options["residual-bp"] = true;
+		}
+		else if (option == "-bp-messages" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+"))) {
+			FactorGraph::message_budget = stoul(argv[++i]);
+		}
+		else if (option == "-bp-time" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+(\\.[0-9]*)?"))) {
+			FactorGraph::time_budget = stod(argv[++i]);
+		}
+		else if (option == "-jt") {
+			options["junction-tree"] = true;
+		}
+		else if (option == "-joint") {
+			options["joint"] = true;
+		}
+		else if (option == "-ijgp") {
+			options["join-graph"] = true;
+		}
+		else if (option == "-ibound" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+"))) {
+			JoinGraph::ibound = stoul(argv[++i]);
+		}
+		else if (option == "-log") {
+			options["log-space"] = true;
+		}
+		else if (option == "-threads" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+"))) {
+			ThreadPool::set_threads(stoul(argv[++i]));
+		}
+		else if (option == "-parallel-min" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+"))) {
+			Factor::parallel_min_size = stoul(argv[++i]);
+		}
+		else if (option == "-order-budget" && i + 1 < argc && regex_match(argv[i+1], regex("[0-9]+(\\.[0-9]*)?"))) {
+			Graph::order_budget = stod(argv[++i]);
+		}
 	}
 }
 
@@ -136,7 +213,13 @@ void
 execute_partition()
 {
 	double uptime;
-	double p = log10(model->partition(evidence, options, uptime));
+	double p;
+	if (options["log-space"]) {
+		p = model->log_partition(evidence, options, uptime) / log(10.0);
+	}
+	else {
+		p = log10(model->partition(evidence, options, uptime));
+	}
 	cout << "Partition = " << p << endl << endl;
 	cout << ">> Executed in " << uptime << "ms." << endl << endl;
 }
@@ -1,9 +1,16 @@
 #include "model.hh"
 #include "graph.hh"
+#include "arena.hh"
+#include "join_graph.hh"
+#include "thread_pool.hh"
 
 #include <unordered_set>
-#include <forward_list>
+#include <set>
+#include <atomic>
 #include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <random>
 #include <chrono>
 #include <cassert>
 #include <cmath>
@@ -11,6 +18,9 @@ using namespace std;
 
 namespace bn {
 
+double BN::memory_budget = 1024.0 * 1024 * 1024;
+const unsigned long BN::PLAN_SAMPLES = 100000;
+
 Model::Model(string name, vector<Variable*> &variables, vector<Factor*> &factors) :
 	_name(name),
 	_variables(variables),
@@ -20,12 +30,16 @@ Model::Model(string name, vector<Variable*> &variables, vector<Factor*> &factors
 
 Model::~Model()
 {
-	for (auto pv : _variables) {
-		delete pv;
-	}
+	// cached results share domains with the factors, release them first
+	_results.invalidate();
+
+	// factors go first, their domains point to the variables
 	for (auto pf : _factors) {
 		delete pf;
 	}
+	for (auto pv : _variables) {
+		delete pv;
+	}
 }
 
 Factor
@@ -48,6 +62,18 @@ Model::joint_distribution(const unordered_map<unsigned,unsigned> &evidence) cons
 	return f;
 }
 
+// Options for variable elimination, with min-fill when none of the
+// heuristics is given.
+static unordered_map<string,bool>
+greedy_options(unordered_map<string,bool> &options)
+{
+	unordered_map<string,bool> ve_options(options);
+	if (!options["min-fill"] && !options["weighted-min-fill"] && !options["min-degree"]) {
+		ve_options["min-fill"] = true;
+	}
+	return ve_options;
+}
+
 double
 Model::partition(
 	const unordered_map<unsigned,unsigned> &evidence,
@@ -56,8 +82,23 @@ Model::partition(
 {
 	auto start = chrono::steady_clock::now();
 
-	Factor f = joint_distribution(evidence);
-	double p = f.partition();
+	double p;
+	if (options["junction-tree"]) {
+		p = junction_tree(evidence, options).partition();
+	}
+	else if (options["sum-product"]) {
+		p = exp(log_partition_sp(evidence, options));
+	}
+	else if (options["joint"]) {
+		Factor f = joint_distribution(evidence);
+		p = f.partition();
+	}
+	// variable elimination by default
+	else {
+		unordered_map<string,bool> ve_options = greedy_options(options);
+		Factor part = partition_ve(evidence, ve_options);
+		p = part.log_space() ? exp(part.partition()) : part.partition();
+	}
 
 	auto end = chrono::steady_clock::now();
 	auto diff = end - start;
@@ -66,6 +107,42 @@ Model::partition(
 	return p;
 }
 
+double
+Model::log_partition(
+	const unordered_map<unsigned,unsigned> &evidence,
+	unordered_map<string,bool> &options,
+	double &uptime) const
+{
+	auto start = chrono::steady_clock::now();
+
+	double lp;
+	if (options["junction-tree"]) {
+		lp = junction_tree(evidence, options).log_partition();
+	}
+	else if (options["sum-product"]) {
+		lp = log_partition_sp(evidence, options);
+	}
+	else if (options["joint"]) {
+		Factor f = Factor(1.0).log();
+		for (auto pf : _factors) {
+			f *= pf->conditioning(evidence).log();
+		}
+		lp = f.partition();
+	}
+	// variable elimination by default
+	else {
+		unordered_map<string,bool> ve_options = greedy_options(options);
+		Factor part = partition_ve(evidence, ve_options);
+		lp = part.log_space() ? part.partition() : log(part.partition());
+	}
+
+	auto end = chrono::steady_clock::now();
+	auto diff = end - start;
+	uptime = chrono::duration <double, milli> (diff).count();
+
+	return lp;
+}
+
 vector<const Factor*>
 Model::marginals(
 	const unordered_map<unsigned,unsigned> &evidence,
@@ -74,11 +151,42 @@ Model::marginals(
 {
 	auto start = chrono::steady_clock::now();
 
-	Factor joint = joint_distribution(evidence).normalize();
-
 	vector<const Factor*> marg;
-	for (auto pv : _variables) {
-		marg.push_back(new Factor(marginal(pv, joint)));
+	if (options["sum-product"]) {
+		marg = marginals_sp(evidence, options);
+	}
+	else if (options["join-graph"]) {
+		marg = marginals_ijgp(evidence, options);
+	}
+	else if (options["junction-tree"]) {
+		JunctionTree jt = junction_tree(evidence, options);
+		marg.resize(_variables.size());
+		TaskGroup group;
+		for (unsigned i = 0; i < _variables.size(); ++i) {
+			group.run([&, i]() { marg[i] = new Factor(jt.marginal(_variables[i])); });
+		}
+		group.wait();
+	}
+	else if (options["joint"] && options["log-space"]) {
+		Factor joint = Factor(1.0).log();
+		for (auto pf : _factors) {
+			joint *= pf->conditioning(evidence).log();
+		}
+		joint = joint.normalize();
+		for (auto pv : _variables) {
+			marg.push_back(new Factor(marginal(pv, joint).exp()));
+		}
+	}
+	else if (options["joint"]) {
+		Factor joint = joint_distribution(evidence).normalize();
+		for (auto pv : _variables) {
+			marg.push_back(new Factor(marginal(pv, joint)));
+		}
+	}
+	// variable elimination by default
+	else {
+		unordered_map<string,bool> ve_options = greedy_options(options);
+		marg = marginals_ve(evidence, ve_options);
 	}
 
 	auto end = chrono::steady_clock::now();
@@ -100,6 +208,343 @@ Model::marginal(const Variable *v, Factor &joint) const
 	return f;
 }
 
+JunctionTree
+Model::junction_tree(
+	const unordered_map<unsigned,unsigned> &evidence,
+	unordered_map<string,bool> &options) const
+{
+	vector<const Variable*> variables(_variables.begin(), _variables.end());
+	vector<const Factor*> factors(_factors.begin(), _factors.end());
+
+	JunctionTree jt(variables, factors, options);
+	jt.calibrate(evidence);
+
+	if (options["verbose"]) {
+		cout << ">> " << jt << endl << endl;
+	}
+
+	return jt;
+}
+
+Factor
+Model::partition_ve(
+	const unordered_map<unsigned,unsigned> &evidence,
+	unordered_map<string,bool> &options) const
+{
+	vector<const Variable*> variables;
+	for (auto const pv : _variables) {
+		if (evidence.find(pv->id()) == evidence.end()) {
+			variables.push_back(pv);
+		}
+	}
+	vector<const Factor*> factors;
+	for (auto const pf : _factors) {
+		factors.push_back(new Factor(pf->conditioning(evidence)));
+	}
+	Factor part = variable_elimination(variables, factors, options);
+	assert(part.size() == 1);
+	for (auto const pf : factors) {
+		delete pf;
+	}
+	factors.clear();
+	return part;
+}
+
+vector<const Factor*>
+Model::marginals_ve(
+	const unordered_map<unsigned,unsigned> &evidence,
+	unordered_map<string,bool> &options) const
+{
+	vector<const Factor*> marg;
+	vector<const Factor*> factors;
+	for (auto const pf : _factors) {
+		factors.push_back(new Factor(pf->conditioning(evidence)));
+	}
+
+	// one ordering of all the variables for every marginal, so that the
+	// heuristic and the order budget are spent once per query
+	vector<unsigned> ordering;
+	if (options["min-fill"] || options["weighted-min-fill"] || options["min-degree"] || Graph::order_budget > 0) {
+		vector<const Variable*> model_variables(_variables.begin(), _variables.end());
+		OrderingCache &cache = OrderingCache::instance();
+
+		OrderStats stats;
+		ordering = cache.ordering(model_variables, factors, model_variables, stats, options);
+
+		if (options["verbose"]) {
+			cout << ">> " << cache << endl;
+			cout << ">> Original elimination order (width = " << stats.width << ")" << endl;
+			cout << "  ";
+			for (auto id : ordering) {
+				cout << " " << id;
+			}
+			cout << endl << endl;
+		}
+	}
+
+	for (auto const pv : _variables) {
+		vector<const Variable*> vars;
+		for (auto const pv2 : _variables) {
+			if (pv2 != pv) {
+				vars.push_back(pv2);
+			}
+		}
+		Factor f = variable_elimination(vars, factors, options, ordering.empty() ? nullptr : &ordering);
+		marg.push_back(new Factor(f.normalize().exp()));
+	}
+
+	for (auto const pf : factors) {
+		delete pf;
+	}
+
+	return marg;
+}
+
+vector<const Factor*>
+Model::marginals_sp(
+	const unordered_map<unsigned,unsigned> &evidence,
+	unordered_map<string,bool> &options) const
+{
+	vector<const Factor*> marg;
+	FactorGraph g = sum_product(evidence, options["log-space"], options["residual-bp"]);
+	for (auto const pv : _variables) {
+		marg.push_back(new Factor(g.marginal(pv)));
+	}
+	if (options["verbose"]) {
+		cout << ">> Belief propagation: " << g.updates() << " message updates, " << (g.converged() ? "converged" : "not converged") << endl << endl;
+	}
+	return marg;
+}
+
+double
+Model::log_partition_sp(
+	const unordered_map<unsigned,unsigned> &evidence,
+	unordered_map<string,bool> &options) const
+{
+	FactorGraph g = sum_product(evidence, options["log-space"], options["residual-bp"]);
+	if (options["verbose"]) {
+		cout << ">> Belief propagation: " << g.updates() << " message updates, " << (g.converged() ? "converged" : "not converged") << endl << endl;
+	}
+	return g.log_partition();
+}
+
+vector<const Factor*>
+Model::marginals_ijgp(
+	const unordered_map<unsigned,unsigned> &evidence,
+	unordered_map<string,bool> &options) const
+{
+	vector<const Variable*> variables(_variables.begin(), _variables.end());
+	vector<Factor> conditioned;
+	conditioned.reserve(_factors.size());
+	for (auto const pf : _factors) {
+		conditioned.push_back(pf->conditioning(evidence));
+	}
+	vector<const Factor*> factors;
+	for (auto const &f : conditioned) {
+		factors.push_back(&f);
+	}
+
+	JoinGraph jg(variables, factors, options);
+	unsigned iterations = jg.update(10000, 0.001);
+
+	vector<const Factor*> marg(_variables.size());
+	TaskGroup group;
+	for (unsigned i = 0; i < _variables.size(); ++i) {
+		group.run([&, i]() { marg[i] = new Factor(jg.marginal(_variables[i])); });
+	}
+	group.wait();
+
+	if (options["verbose"]) {
+		cout << ">> " << jg << endl;
+		cout << ">> Join-graph propagation: " << iterations << " iterations, " << (jg.converged() ? "converged" : "not converged") << endl << endl;
+	}
+	return marg;
+}
+
+Factor
+Model::variable_elimination(
+	vector<const Variable*> &variables,
+	vector<const Factor*> &factors,
+	unordered_map<string,bool> &options,
+	const vector<unsigned> *ordering) const
+{
+	// initialize result
+	Factor result(1.0);
+
+	// choose elimination ordering
+	vector<const Variable*> vars = variables;
+
+	if (ordering) {
+		unordered_set<unsigned> ids;
+		for (auto const pv : variables) {
+			ids.insert(pv->id());
+		}
+		vars.clear();
+		for (auto id : *ordering) {
+			if (ids.count(id)) {
+				vars.push_back(_variables.at(id));
+			}
+		}
+		assert(vars.size() == variables.size());
+	}
+	else if (options["min-fill"] || options["weighted-min-fill"] || options["min-degree"] || Graph::order_budget > 0) {
+		vector<const Variable*> model_variables(_variables.begin(), _variables.end());
+		OrderingCache &cache = OrderingCache::instance();
+
+		OrderStats stats;
+		vector<unsigned> ids = cache.ordering(model_variables, factors, variables, stats, options);
+
+		for (unsigned i = 0; i < ids.size(); ++i) {
+			vars[i] = _variables.at(ids[i]);
+		}
+
+		if (options["verbose"]) {
+			cout << ">> " << cache << endl;
+			cout << ">> Original elimination order (width = " << stats.width << ")" << endl;
+			cout << "  ";
+			for (auto const pv : vars) {
+				cout << " " << pv->id();
+			}
+			cout << endl << endl;
+		}
+	}
+
+	// per-query storage of intermediate factors
+	Arena arena;
+	bool log_space = options["log-space"];
+
+	// log-space queries work on log copies of the input factors
+	vector<const Factor*> inputs = factors;
+	if (log_space) {
+		for (auto &pf : inputs) {
+			pf = arena.factor(pf->log());
+		}
+	}
+
+	// initialize buckets
+	unsigned n = vars.size();
+	unordered_map<unsigned,unsigned> position;
+	for (unsigned k = 0; k < n; ++k) {
+		position[vars[k]->id()] = k;
+	}
+
+	vector<vector<const Factor*>> buckets(n);
+	vector<set<unsigned>> scopes(n);  // positions of the variables in the scope of each bucket
+	for (auto pf : inputs) {
+		set<unsigned> scope;
+		const Domain &d = pf->domain();
+		for (unsigned i = 0; i < d.width(); ++i) {
+			auto it = position.find(d[i]->id());
+			if (it != position.end()) {
+				scope.insert(it->second);
+			}
+		}
+		if (scope.empty()) {
+			result *= *pf;
+			continue;
+		}
+		unsigned k = *scope.begin();
+		buckets[k].push_back(pf);
+		scopes[k].insert(scope.begin(), scope.end());
+	}
+
+	// bucket tree: the message of each bucket goes to the bucket of the
+	// earliest eliminated variable left in its scope, into a slot after
+	// the input factors of that bucket
+	vector<unsigned> ninputs(n);
+	for (unsigned k = 0; k < n; ++k) {
+		ninputs[k] = buckets[k].size();
+	}
+	vector<int> parent(n, -1);
+	vector<unsigned> slot(n, 0);
+	for (unsigned k = 0; k < n; ++k) {
+		scopes[k].erase(k);
+		if (scopes[k].empty()) continue;
+
+		unsigned p = *scopes[k].begin();
+		parent[k] = p;
+		slot[k] = buckets[p].size();
+		buckets[p].push_back(nullptr);
+		scopes[p].insert(scopes[k].begin(), scopes[k].end());
+	}
+
+	vector<atomic<unsigned>> waiting(n);
+	vector<unsigned> leaves;
+	for (unsigned k = 0; k < n; ++k) {
+		waiting[k].store(buckets[k].size() - ninputs[k]);
+		if (buckets[k].size() == ninputs[k]) {
+			leaves.push_back(k);
+		}
+	}
+
+	// eliminate independent buckets in parallel: each task goes up the tree
+	// from a leaf as long as it delivers the last message of the next bucket
+	vector<const Factor*> messages(n, nullptr);
+	TaskGroup group;
+	for (auto leaf : leaves) {
+		group.run([&, leaf]() {
+			unsigned k = leaf;
+			while (true) {
+				// eliminate var without materializing the bucket product
+				const Factor *message = arena.factor(Factor::eliminate(buckets[k], vars[k], &arena));
+				messages[k] = message;
+
+				// intermediate factors of the bucket are no longer needed,
+				// the arena keeps its hands off the model factors
+				for (auto const pf : buckets[k]) {
+					arena.recycle(pf);
+				}
+
+				int p = parent[k];
+				if (p < 0) break;
+				buckets[p][slot[k]] = message;
+				messages[k] = nullptr;
+				if (--waiting[p] > 0) break;
+				k = p;
+			}
+		});
+	}
+	group.wait();
+
+	for (auto pf : messages) {
+		if (pf) {
+			result *= *pf;
+		}
+	}
+
+	if (options["verbose"]) {
+		cout << ">> " << arena << endl << endl;
+	}
+
+	return result;
+}
+
+FactorGraph
+Model::sum_product(
+	const unordered_map<unsigned,unsigned> &evidence,
+	bool log_space,
+	bool residual) const
+{
+	vector<const Variable*> variables(_variables.begin(), _variables.end());
+	vector<Factor> conditioned;
+	for (auto const pf : _factors) {
+		conditioned.push_back(pf->conditioning(evidence));
+	}
+	vector<const Factor*> factors;
+	for (auto const &f : conditioned) {
+		factors.push_back(&f);
+	}
+
+	FactorGraph g(variables, factors, log_space);
+	if (residual) {
+		g.update_residual(0.001);
+	}
+	else {
+		g.update(10000, 0.001);
+	}
+
+	return g;
+}
 
 BN::BN(string name, vector<Variable*> &variables, vector<Factor*> &factors) : Model(name, variables, factors)
 {
@@ -153,6 +598,16 @@ BN::query(
 {
 	auto start = chrono::steady_clock::now();
 
+	Factor f;
+	string key;
+	if (!options["no-result-cache"]) {
+		key = QueryCache::key("joint", target, evidence, options);
+		if (_results.find(key, f)) {
+			uptime = chrono::duration <double, milli> (chrono::steady_clock::now() - start).count();
+			return f;
+		}
+	}
+
 	Factor joint(1.0);
 	if (options["bayes-ball"]) {
 		unordered_set<const Variable*> Np, Ne, F;
@@ -180,7 +635,7 @@ BN::query(
 		joint = joint_distribution();
 	}
 
-	Factor f = joint;
+	f = move(joint);
 	for (auto pv : _variables) {
 		if (target.find(pv) == target.end() && evidence.find(pv) == evidence.end()) {
 			f = f.sum_out(pv);
@@ -193,6 +648,9 @@ BN::query(
 		}
 		f = f.divide(g);
 	}
+	if (!key.empty()) {
+		_results.insert(key, f);
+	}
 
 	auto end = chrono::steady_clock::now();
 	auto diff = end - start;
@@ -210,12 +668,23 @@ BN::query_ve(
 {
 	auto start = chrono::steady_clock::now();
 
+	string key;
+	if (!options["no-result-cache"]) {
+		Factor f;
+		key = QueryCache::key("ve@" + to_string(Graph::order_budget), target, evidence, options);
+		if (_results.find(key, f)) {
+			uptime = chrono::duration <double, milli> (chrono::steady_clock::now() - start).count();
+			return f;
+		}
+	}
+
 	vector<const Variable*> variables;
 	vector<const Factor*> factors;
 	if (options["bayes-ball"]) {
 		unordered_set<const Variable*> Np, Ne, F;
 		bayes_ball(target, evidence, F, Np, Ne);
-		for (auto pv : Np) {
+		for (auto pv : _variables) {
+			if (Np.find(pv) == Np.end()) continue;
 			if (target.find(pv) == target.end() && evidence.find(pv) == evidence.end()) {
 				variables.push_back(pv);
 			}
@@ -239,6 +708,260 @@ BN::query_ve(
 		}
 		f = f.divide(g);
 	}
+	f = f.exp();
+	if (!key.empty()) {
+		_results.insert(key, f);
+	}
+
+	auto end = chrono::steady_clock::now();
+	auto diff = end - start;
+	uptime = chrono::duration <double, milli> (diff).count();
+
+	return f;
+}
+
+Factor
+BN::query_sampling(
+	const unordered_set<const Variable*> &target,
+	const unordered_set<const Variable*> &evidence,
+	unsigned long samples,
+	double &uptime) const
+{
+	auto start = chrono::steady_clock::now();
+
+	unordered_set<const Variable*> query(target.begin(), target.end());
+	query.insert(evidence.begin(), evidence.end());
+	vector<const Variable*> scope(query.begin(), query.end());
+	sort(scope.begin(), scope.end(), [](const Variable *v1, const Variable *v2) { return v1->id() < v2->id(); });
+	shared_ptr<const Domain> domain = Domain::intern(Domain(scope));
+
+	// ancestral sampling restricted to the query variables and their
+	// ancestors, reading each value straight from the column of its CPT
+	unordered_set<const Variable*> relevant = ancestors(query);
+	relevant.insert(query.begin(), query.end());
+	vector<Factor> cpts;
+	for (auto pf : topological_sampling_order()) {
+		if (relevant.find(pf->domain()[0]) != relevant.end()) {
+			cpts.push_back(pf->sparse() ? pf->to_dense() : *pf);
+		}
+	}
+	vector<vector<unsigned>> parents(cpts.size());
+	for (unsigned k = 0; k < cpts.size(); ++k) {
+		parents[k].assign(cpts[k].width(), 0);
+	}
+
+	mt19937 rng(random_device{}());
+	uniform_real_distribution<double> uniform(0.0, 1.0);
+
+	vector<double> values(domain->size(), 0.0);
+	vector<unsigned> valuation(domain->width());
+	vector<unsigned> sample(_variables.size(), 0);
+	for (unsigned long i = 0; i < samples; ++i) {
+		for (unsigned k = 0; k < cpts.size(); ++k) {
+			const Factor &f = cpts[k];
+			const Domain &d = f.domain();
+			const Variable *v = d[0];
+			for (unsigned j = 1; j < d.width(); ++j) {
+				parents[k][j] = sample[d[j]->id()];
+			}
+			unsigned pos = d.position_valuation(parents[k]);
+			unsigned stride = d.stride(v);
+
+			double total = 0.0;
+			for (unsigned x = 0; x < v->size(); ++x) {
+				total += f[pos + x * stride];
+			}
+			double u = uniform(rng) * total;
+			unsigned x = 0;
+			double p = f[pos];
+			while (x + 1 < v->size() && u > p) {
+				p += f[pos + (++x) * stride];
+			}
+			sample[v->id()] = x;
+		}
+
+		for (unsigned j = 0; j < domain->width(); ++j) {
+			valuation[j] = sample[(*domain)[j]->id()];
+		}
+		values[domain->position_valuation(valuation)] += 1.0;
+	}
+
+	// each evidence row is normalized by its own count, rows never sampled
+	// are left uniform over the target
+	vector<const Variable*> evidence_scope(evidence.begin(), evidence.end());
+	sort(evidence_scope.begin(), evidence_scope.end(), [](const Variable *v1, const Variable *v2) { return v1->id() < v2->id(); });
+	Domain evidence_domain(evidence_scope);
+	vector<double> rows(evidence_domain.size(), 0.0);
+	unsigned rest = domain->size() / evidence_domain.size();
+
+	fill(valuation.begin(), valuation.end(), 0);
+	for (unsigned i = 0; i < domain->size(); ++i) {
+		rows[evidence_domain.position_consistent_valuation(valuation, *domain)] += values[i];
+		domain->next_valuation(valuation);
+	}
+	double partition = 0.0;
+	fill(valuation.begin(), valuation.end(), 0);
+	for (unsigned i = 0; i < domain->size(); ++i) {
+		double count = rows[evidence_domain.position_consistent_valuation(valuation, *domain)];
+		values[i] = (count > 0.0) ? values[i] / count : 1.0 / rest;
+		partition += values[i];
+		domain->next_valuation(valuation);
+	}
+
+	Factor f(domain, move(values), partition);
+
+	auto end = chrono::steady_clock::now();
+	auto diff = end - start;
+	uptime = chrono::duration <double, milli> (diff).count();
+
+	return f;
+}
+
+QueryPlan
+BN::plan(
+	const unordered_set<const Variable*> &target,
+	const unordered_set<const Variable*> &evidence) const
+{
+	QueryPlan plan;
+
+	// requisite subgraph of the query
+	unordered_set<const Variable*> Np, Ne, F;
+	bayes_ball(target, evidence, F, Np, Ne);
+
+	vector<const Variable*> variables;
+	vector<const Factor*> factors;
+	unordered_set<const Variable*> scope;
+	for (auto pv : _variables) {
+		// in id order, the original order of the ve estimate
+		if (Np.find(pv) == Np.end()) continue;
+		if (target.find(pv) == target.end() && evidence.find(pv) == evidence.end()) {
+			variables.push_back(pv);
+		}
+		const Factor *pf = _factors[pv->id()];
+		factors.push_back(pf);
+		vector<const Variable*> vars = pf->domain().scope();
+		scope.insert(vars.begin(), vars.end());
+	}
+	plan.nvariables = scope.size();
+	plan.nfactors = factors.size();
+
+	// every engine ends with a table over target and evidence
+	double result = 1.0;
+	for (auto pv : target) {
+		result *= pv->size();
+	}
+	for (auto pv : evidence) {
+		if (target.find(pv) == target.end()) {
+			result *= pv->size();
+		}
+	}
+
+	// product of all requisite factors
+	double joint = 1.0;
+	for (auto pv : scope) {
+		joint *= pv->size();
+	}
+	unsigned width = scope.empty() ? 0 : scope.size() - 1;
+	plan.estimates.push_back({ "joint", "", true, width, 2 * joint * sizeof(double), joint * max((size_t) 1, factors.size()), false });
+
+	// variable elimination with the original order and each heuristic
+	vector<const Variable*> model_variables(_variables.begin(), _variables.end());
+	for (string heuristic : { "", "min-degree", "min-fill", "weighted-min-fill" }) {
+		OrderStats stats;
+		if (heuristic.empty()) {
+			vector<unsigned> ids;
+			for (auto pv : variables) {
+				ids.push_back(pv->id());
+			}
+			stats = Graph(model_variables, factors).order_stats(ids);
+		}
+		else {
+			unordered_map<string,bool> order_options;
+			order_options[heuristic] = true;
+			// greedy orderings, the budget goes to the engine that runs
+			OrderingCache::instance().ordering(model_variables, factors, variables, stats, order_options, false);
+		}
+		plan.estimates.push_back({ "ve", heuristic, true, stats.width, stats.bytes + result * sizeof(double), stats.madds + result, false });
+	}
+
+	// ancestral sampling of the query variables and their ancestors
+	unordered_set<const Variable*> query(target.begin(), target.end());
+	query.insert(evidence.begin(), evidence.end());
+	unordered_set<const Variable*> relevant = ancestors(query);
+	relevant.insert(query.begin(), query.end());
+	double draws = 0.0;
+	for (auto pv : relevant) {
+		draws += pv->size();
+	}
+	plan.estimates.push_back({ "sampling", "", false, 0, result * sizeof(double), PLAN_SAMPLES * draws, false });
+
+	unsigned sampling = plan.estimates.size() - 1;
+	plan.chosen = sampling;
+	for (unsigned k = 0; k < plan.estimates.size(); ++k) {
+		QueryEstimate &e = plan.estimates[k];
+		e.fits = (e.bytes <= memory_budget);
+		if (!e.exact || !e.fits) continue;
+		if (plan.chosen == sampling || e.madds < plan.estimates[plan.chosen].madds) {
+			plan.chosen = k;
+		}
+	}
+
+	return plan;
+}
+
+Factor
+BN::query_planned(
+	const unordered_set<const Variable*> &target,
+	const unordered_set<const Variable*> &evidence,
+	unordered_map<string,bool> &options,
+	double &uptime) const
+{
+	auto start = chrono::steady_clock::now();
+
+	Factor f;
+	string key;
+	if (!options["no-result-cache"]) {
+		key = QueryCache::key("plan@" + to_string(Graph::order_budget) + "," + to_string(memory_budget), target, evidence, options);
+		if (_results.find(key, f)) {
+			uptime = chrono::duration <double, milli> (chrono::steady_clock::now() - start).count();
+			return f;
+		}
+	}
+
+	QueryPlan p = plan(target, evidence);
+	const QueryEstimate &e = p.estimates[p.chosen];
+
+	// exact planned results are cached once, under the key of this query
+	unordered_map<string,bool> engine_options = options;
+	engine_options["no-result-cache"] = true;
+	engine_options["bayes-ball"] = true;
+	for (string heuristic : { "min-degree", "min-fill", "weighted-min-fill" }) {
+		engine_options[heuristic] = (e.heuristic == heuristic);
+	}
+
+	if (e.engine == "joint") {
+		f = query(target, evidence, engine_options, uptime);
+	}
+	else if (e.engine == "ve") {
+		f = query_ve(target, evidence, engine_options, uptime);
+	}
+	else {
+		f = query_sampling(target, evidence, PLAN_SAMPLES, uptime);
+	}
+
+	// evidence that bayes-ball finds d-separated from the target does not
+	// change the result, it is put back to keep the scope of the query
+	for (auto const pv : evidence) {
+		if (!f.domain().in_scope(pv)) {
+			Factor ones(Domain::intern(Domain(vector<const Variable*>(1, pv))), 1.0);
+			f *= f.log_space() ? ones.log() : ones;
+		}
+	}
+
+	// sampling estimates are drawn again for every query
+	if (!key.empty() && e.exact) {
+		_results.insert(key, f);
+	}
 
 	auto end = chrono::steady_clock::now();
 	auto diff = end - start;
@@ -272,25 +995,13 @@ BN::partition(
 		long unsigned burn_in = 10000;
 		p = gibbs_sampling(evidence, M, burn_in);
 	}
+	else if (options["junction-tree"]) {
+		p = junction_tree(evidence, options).partition();
+	}
 	// variable elimination by default
 	else {
-		vector<const Variable*> variables;
-		for (auto const pv : _variables) {
-			if (evidence.find(pv->id()) == evidence.end()) {
-				variables.push_back(pv);
-			}
-		}
-		vector<const Factor*> factors;
-		for (auto const pf : _factors) {
-			factors.push_back(new Factor(pf->conditioning(evidence)));
-		}
-		Factor part = variable_elimination(variables, factors, options);
-		assert(part[0] == part.partition());
-		p = part.partition();
-		for (auto const pf : factors) {
-			delete pf;
-		}
-		factors.clear();
+		Factor part = partition_ve(evidence, options);
+		p = part.log_space() ? exp(part.partition()) : part.partition();
 	}
 
 	auto end = chrono::steady_clock::now();
@@ -300,149 +1011,55 @@ BN::partition(
 	return p;
 }
 
-vector<const Factor*>
-BN::marginals(
+double
+BN::log_partition(
 	const unordered_map<unsigned,unsigned> &evidence,
 	unordered_map<string,bool> &options,
 	double &uptime) const
 {
-	auto start = chrono::steady_clock::now();
+	// sampling estimates are computed in linear space
+	if (options["logical-sampling"] || options["likelihood-weighting"] || options["gibbs-sampling"]) {
+		return log(partition(evidence, options, uptime));
+	}
 
-	vector<const Factor*> marg;
+	auto start = chrono::steady_clock::now();
 
-	if (options["sum-product"]) {
-		FactorGraph g = sum_product();
-		for (auto const pv : _variables) {
-			marg.push_back(new Factor(g.marginal(pv)));
-		}
+	double lp;
+	if (options["junction-tree"]) {
+		lp = junction_tree(evidence, options).log_partition();
 	}
-	// variable elimination by default
 	else {
-		vector<const Factor*> factors;
-		for (auto const pf : _factors) {
-			factors.push_back(new Factor(pf->conditioning(evidence)));
-		}
-
-		for (auto const pv : _variables) {
-			vector<const Variable*> vars;
-			for (auto const pv2 : _variables) {
-				if (pv2 != pv) {
-					vars.push_back(pv2);
-				}
-			}
-			marg.push_back(new Factor(variable_elimination(vars, factors, options).normalize()));
-		}
-
-		for (auto const pf : factors) {
-			delete pf;
-		}
+		Factor part = partition_ve(evidence, options);
+		lp = part.log_space() ? part.partition() : log(part.partition());
 	}
 
 	auto end = chrono::steady_clock::now();
 	auto diff = end - start;
 	uptime = chrono::duration <double, milli> (diff).count();
 
-	return marg;
+	return lp;
 }
 
-Factor
-BN::variable_elimination(
-	vector<const Variable*> &variables,
-	vector<const Factor*> &factors,
-	unordered_map<string,bool> &options) const
+vector<const Factor*>
+BN::marginals(
+	const unordered_map<unsigned,unsigned> &evidence,
+	unordered_map<string,bool> &options,
+	double &uptime) const
 {
-	// initialize result
-	Factor result(1.0);
-
-	// choose elimination ordering
-	vector<const Variable*> vars = variables;
-
-	if (options["min-fill"] || options["weighted-min-fill"] || options["min-degree"]) {
-		vector<const Variable*> model_variables(_variables.begin(), _variables.end());
-		Graph g(model_variables, factors);
-
-		unsigned width = 0;
-		vector<unsigned> ids = g.ordering(variables, width, options);
-
-		for (unsigned i = 0; i < ids.size(); ++i) {
-			vars[i] = _variables.at(ids[i]);
-		}
-
-		if (options["verbose"]) {
-			unsigned width = g.order_width(vars);
-			cout << ">> Original elimination order (width = " << width << ")" << endl;
-			cout << "  ";
-			for (auto const pv : vars) {
-				cout << " " << pv->id();
-			}
-			cout << endl << endl;
-		}
-	}
-
-	forward_list<const Variable*> ordering(vars.begin(), vars.end());
-
-	// initialize buckets
-	unordered_map<unsigned,unordered_set<const Factor*>> buckets;
-
-	// initialize new_factor_lst
-	vector<const Factor*> new_factor_lst;
-
-	for (auto pv : ordering) {
-		unordered_set<const Factor*> bfactors;
-		buckets[pv->id()] = bfactors;
-	}
-	for (auto pf : factors) {
-		bool in_bucket = false;
-		for (auto pv : ordering) {
-			if (pf->domain().in_scope(pv)) {
-				buckets[pv->id()].insert(pf);
-				in_bucket = true;
-				break;
-			}
-		}
-		if (!in_bucket) {
-			result *= *pf;
-		}
+	if (options["sum-product"] || options["junction-tree"] || options["join-graph"]) {
+		return Model::marginals(evidence, options, uptime);
 	}
 
-	// eliminate all variables
-	while (!ordering.empty()) {
-		const Variable *var = ordering.front();
-		ordering.pop_front();
-
-		// eliminate var
-		Factor prod(1.0);
-		for (auto pf : buckets[var->id()]) {
-			prod *= *pf;
-		}
-		Factor *new_factor = new Factor(prod.sum_out(var));
-		new_factor_lst.push_back(new_factor);
-
-		// stop if finished
-		if (buckets.empty()) {
-			result *= *new_factor;
-			break;
-		}
+	// variable elimination by default
+	auto start = chrono::steady_clock::now();
 
-		// update bucket list with new factor
-		bool in_bucket = false;
-		for (auto pv : ordering) {
-			if (new_factor->domain().in_scope(pv)) {
-				buckets[pv->id()].insert(new_factor);
-				in_bucket = true;
-				break;
-			}
-		}
-		if (!in_bucket) {
-			result *= *new_factor;
-		}
-	}
+	vector<const Factor*> marg = marginals_ve(evidence, options);
 
-	for (auto pf : new_factor_lst) {
-		delete pf;
-	}
+	auto end = chrono::steady_clock::now();
+	auto diff = end - start;
+	uptime = chrono::duration <double, milli> (diff).count();
 
-	return result;
+	return marg;
 }
 
 void
@@ -733,25 +1350,6 @@ BN::gibbs_sampling(const unordered_map<unsigned,unsigned> &evidence, long unsign
 	return 1.0*N/M;
 }
 
-FactorGraph
-BN::sum_product(void) const
-{
-	vector<const Variable*> variables;
-	for (auto const pv : _variables) {
-		variables.push_back(pv);
-	}
-	vector<const Factor*> factors;
-	for (auto const pf : _factors) {
-		factors.push_back(pf);
-	}
-	FactorGraph g(variables, factors);
-
-	unsigned iterations = g.update(10000, 0.001);
-	// cout << ">> Number of iterations = " <<  iterations << endl;
-
-	return g;
-}
-
 bool
 BN::m_separated(const Variable *v1, const Variable *v2, const unordered_set<const Variable*> evidence, bool verbose) const
 {
@@ -949,6 +1547,32 @@ BN::write(ostream& os) const
 	}
 }
 
+ostream&
+operator<<(ostream &os, const QueryPlan &plan)
+{
+	os << "QueryPlan(variables:" << plan.nvariables << ", factors:" << plan.nfactors << ", memory budget:" << BN::memory_budget << " bytes)" << endl;
+	for (unsigned k = 0; k < plan.estimates.size(); ++k) {
+		const QueryEstimate &e = plan.estimates[k];
+		string name = e.engine;
+		if (!e.heuristic.empty()) {
+			name += " " + e.heuristic;
+		}
+		os << (k == plan.chosen ? " * " : "   ") << left << setw(22) << name << right;
+		if (e.exact) {
+			os << "width = " << e.width << ", ";
+		}
+		else {
+			os << "samples = " << BN::PLAN_SAMPLES << ", ";
+		}
+		os << "memory = " << e.bytes << " bytes, madds = " << e.madds;
+		if (!e.fits) {
+			os << " (over budget)";
+		}
+		os << endl;
+	}
+	return os;
+}
+
 ostream&
 operator<<(ostream &os, const BN &bn)
 {
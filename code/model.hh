@@ -4,6 +4,8 @@
 #include "variable.hh"
 #include "factor.hh"
 #include "graph.hh"
+#include "junction_tree.hh"
+#include "query_cache.hh"
 
 #include <string>
 #include <vector>
@@ -12,6 +14,28 @@
 
 namespace bn {
 
+// Estimated cost of answering a query with one inference engine.
+struct QueryEstimate {
+	std::string engine;     // "joint", "ve" or "sampling"
+	std::string heuristic;  // ordering option of "ve", empty for the original order
+	bool exact;
+	unsigned width;
+	double bytes;
+	double madds;
+	bool fits;              // within BN::memory_budget
+};
+
+// Engines considered for a query over its requisite subgraph; chosen is
+// the cheapest exact engine that fits the memory budget, or sampling.
+struct QueryPlan {
+	unsigned nvariables;
+	unsigned nfactors;
+	std::vector<QueryEstimate> estimates;
+	unsigned chosen;
+};
+
+std::ostream &operator<<(std::ostream &os, const QueryPlan &plan);
+
 class Model {
 public:
 	Model(std::string name, std::vector<Variable*> &variables, std::vector<Factor*> &factors);
@@ -29,6 +53,11 @@ public:
 		std::unordered_map<std::string,bool> &options,
 		double &uptime) const;
 
+	virtual double log_partition(
+		const std::unordered_map<unsigned,unsigned> &evidence,
+		std::unordered_map<std::string,bool> &options,
+		double &uptime) const;
+
 	virtual std::vector<const Factor*> marginals(
 		const std::unordered_map<unsigned,unsigned> &evidence,
 		std::unordered_map<std::string,bool> &options,
@@ -38,12 +67,56 @@ public:
 		const Variable *v,
 		Factor &joint) const;
 
+	// eliminates the variables in the given ordering, if any, instead of
+	// choosing one with the heuristic options and the order budget
+	Factor variable_elimination(
+		std::vector<const Variable*> &variables,
+		std::vector<const Factor*> &factors,
+		std::unordered_map<std::string,bool> &options,
+		const std::vector<unsigned> *ordering = nullptr) const;
+
+	// loopy belief propagation on the factors conditioned on the evidence
+	FactorGraph sum_product(
+		const std::unordered_map<unsigned,unsigned> &evidence,
+		bool log_space = false,
+		bool residual = false) const;
+
 	virtual void write(std::ostream&) const = 0;
 
+	// cached query results, to be invalidated whenever the factors change
+	QueryCache &results() const { return _results; }
+	void invalidate() { _results.invalidate(); }
+
 protected:
 	std::string _name;
 	std::vector<Variable*> _variables;
 	std::vector<Factor*> _factors;
+	mutable QueryCache _results;
+
+	JunctionTree junction_tree(
+		const std::unordered_map<unsigned,unsigned> &evidence,
+		std::unordered_map<std::string,bool> &options) const;
+
+	Factor partition_ve(
+		const std::unordered_map<unsigned,unsigned> &evidence,
+		std::unordered_map<std::string,bool> &options) const;
+
+	std::vector<const Factor*> marginals_ve(
+		const std::unordered_map<unsigned,unsigned> &evidence,
+		std::unordered_map<std::string,bool> &options) const;
+
+	std::vector<const Factor*> marginals_sp(
+		const std::unordered_map<unsigned,unsigned> &evidence,
+		std::unordered_map<std::string,bool> &options) const;
+
+	// Bethe estimate of the log partition function after belief propagation
+	double log_partition_sp(
+		const std::unordered_map<unsigned,unsigned> &evidence,
+		std::unordered_map<std::string,bool> &options) const;
+
+	std::vector<const Factor*> marginals_ijgp(
+		const std::unordered_map<unsigned,unsigned> &evidence,
+		std::unordered_map<std::string,bool> &options) const;
 };
 
 class BN : public Model {
@@ -55,6 +128,11 @@ public:
 		std::unordered_map<std::string,bool> &options,
 		double &uptime) const;
 
+	double log_partition(
+		const std::unordered_map<unsigned,unsigned> &evidence,
+		std::unordered_map<std::string,bool> &options,
+		double &uptime) const;
+
 	std::vector<const Factor*> marginals(
 		const std::unordered_map<unsigned,unsigned> &evidence,
 		std::unordered_map<std::string,bool> &options,
@@ -72,10 +150,28 @@ public:
 		std::unordered_map<std::string,bool> &options,
 		double &uptime) const;
 
-	Factor variable_elimination(
-		std::vector<const Variable*> &variables,
-		std::vector<const Factor*> &factors,
-		std::unordered_map<std::string,bool> &options) const;
+	Factor query_sampling(
+		const std::unordered_set<const Variable*> &target,
+		const std::unordered_set<const Variable*> &evidence,
+		unsigned long samples,
+		double &uptime) const;
+
+	// estimate the cost of each engine and answer with the cheapest one
+	QueryPlan plan(
+		const std::unordered_set<const Variable*> &target,
+		const std::unordered_set<const Variable*> &evidence) const;
+
+	Factor query_planned(
+		const std::unordered_set<const Variable*> &target,
+		const std::unordered_set<const Variable*> &evidence,
+		std::unordered_map<std::string,bool> &options,
+		double &uptime) const;
+
+	// bytes of intermediate factors allowed to exact engines of the planner
+	static double memory_budget;
+
+	// samples drawn when the planner falls back to sampling
+	static const unsigned long PLAN_SAMPLES;
 
 	void bayes_ball(
 		const std::unordered_set<const Variable*> &J,
@@ -93,8 +189,6 @@ public:
 	double likelihood_weighting(const std::unordered_map<unsigned,unsigned> &evidence, double delta, double epsilon) const;
 	double gibbs_sampling(const std::unordered_map<unsigned,unsigned> &evidence, long unsigned M, long unsigned burn_in) const;
 
-	FactorGraph sum_product(void) const;
-
 	const std::unordered_set<const Variable*> parents(const Variable *v)  const { return _parents.find(v)->second;  };
 	const std::unordered_set<const Variable*> children(const Variable *v) const { return _children.find(v)->second; };
 
@@ -0,0 +1,153 @@
+#include "query_cache.hh"
+
+#include <algorithm>
+#include <vector>
+using namespace std;
+
+namespace bn {
+
+unsigned long QueryCache::default_capacity = 64ul << 20;
+
+QueryCache::QueryCache() : _capacity(default_capacity)
+{
+    _stats.hits = 0;
+    _stats.misses = 0;
+    _stats.evictions = 0;
+    _stats.entries = 0;
+    _stats.bytes = 0;
+}
+
+string
+QueryCache::key(
+    const string &engine,
+    const unordered_set<const Variable*> &target,
+    const unordered_set<const Variable*> &evidence,
+    unordered_map<string,bool> &options)
+{
+    string key = engine;
+
+    for (auto const vars : { &target, &evidence }) {
+        vector<unsigned> ids;
+        for (auto const pv : *vars) {
+            ids.push_back(pv->id());
+        }
+        sort(ids.begin(), ids.end());
+
+        key += "|";
+        for (unsigned i = 0; i < ids.size(); ++i) {
+            if (i > 0) key += ",";
+            key += to_string(ids[i]);
+        }
+    }
+
+    // options that do not change the result are left out
+    vector<string> flags;
+    for (auto const &it : options) {
+        if (it.second && it.first != "verbose" && it.first != "help") {
+            flags.push_back(it.first);
+        }
+    }
+    sort(flags.begin(), flags.end());
+    key += "|";
+    for (auto const &flag : flags) {
+        key += flag + ";";
+    }
+
+    return key;
+}
+
+bool
+QueryCache::find(const string &key, Factor &f)
+{
+    lock_guard<mutex> guard(_lock);
+
+    auto it = _index.find(key);
+    if (it == _index.end()) {
+        _stats.misses++;
+        return false;
+    }
+
+    _lru.splice(_lru.begin(), _lru, it->second);
+    f = Factor(it->second->factor);
+    _stats.hits++;
+    return true;
+}
+
+void
+QueryCache::insert(const string &key, const Factor &f)
+{
+    unsigned long bytes = key.size() + f.nonzeros() * sizeof(double);
+    if (f.sparse()) {
+        bytes += f.nonzeros() * sizeof(unsigned);
+    }
+
+    lock_guard<mutex> guard(_lock);
+    if (bytes > _capacity) return;
+
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+        _stats.bytes -= it->second->bytes;
+        _lru.erase(it->second);
+        _index.erase(it);
+    }
+
+    _lru.push_front(Entry{ key, Factor(f), bytes });
+    _index[key] = _lru.begin();
+    _stats.bytes += bytes;
+    evict();
+}
+
+void
+QueryCache::invalidate()
+{
+    lock_guard<mutex> guard(_lock);
+    _lru.clear();
+    _index.clear();
+    _stats.bytes = 0;
+    _stats.entries = 0;
+}
+
+void
+QueryCache::set_capacity(unsigned long bytes)
+{
+    lock_guard<mutex> guard(_lock);
+    _capacity = bytes;
+    evict();
+}
+
+QueryCacheStats
+QueryCache::stats() const
+{
+    lock_guard<mutex> guard(_lock);
+    return _stats;
+}
+
+void
+QueryCache::evict()
+{
+    while (_stats.bytes > _capacity) {
+        Entry &entry = _lru.back();
+        _stats.bytes -= entry.bytes;
+        _stats.evictions++;
+        _index.erase(entry.key);
+        _lru.pop_back();
+    }
+    _stats.entries = _lru.size();
+}
+
+ostream &
+operator<<(ostream &os, const QueryCache &c)
+{
+    QueryCacheStats stats = c.stats();
+    unsigned long lookups = stats.hits + stats.misses;
+    os << "QueryCache(";
+    os << "entries:" << stats.entries << ", ";
+    os << "bytes:" << stats.bytes << "/" << c.capacity() << ", ";
+    os << "hits:" << stats.hits << ", ";
+    os << "misses:" << stats.misses << ", ";
+    os << "hit rate:" << (lookups ? 1.0 * stats.hits / lookups : 0.0) << ", ";
+    os << "evictions:" << stats.evictions << ")";
+    return os;
+}
+
+}
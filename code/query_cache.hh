@@ -0,0 +1,72 @@
+#ifndef _BN_QUERY_CACHE_H_
+#define _BN_QUERY_CACHE_H_
+
+#include "variable.hh"
+#include "factor.hh"
+
+#include <ostream>
+#include <string>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace bn {
+
+struct QueryCacheStats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long entries;
+    unsigned long bytes;
+};
+
+// Bounded LRU cache of query results, keyed by the engine, the sorted
+// target and evidence variables and the options set for the query. Least
+// recently used results are evicted once their values exceed the memory
+// cap. Results must be invalidated when the factors of the model change.
+class QueryCache {
+public:
+    QueryCache();
+    QueryCache(const QueryCache &c) = delete;
+
+    static std::string key(
+        const std::string &engine,
+        const std::unordered_set<const Variable*> &target,
+        const std::unordered_set<const Variable*> &evidence,
+        std::unordered_map<std::string,bool> &options);
+
+    bool find(const std::string &key, Factor &f);
+    void insert(const std::string &key, const Factor &f);
+
+    void invalidate();
+
+    unsigned long capacity() const { return _capacity; }
+    void set_capacity(unsigned long bytes);
+
+    QueryCacheStats stats() const;
+
+    // memory cap of new caches in bytes, 0 disables caching
+    static unsigned long default_capacity;
+
+    friend std::ostream &operator<<(std::ostream &os, const QueryCache &c);
+
+private:
+    struct Entry {
+        std::string key;
+        Factor factor;
+        unsigned long bytes;
+    };
+
+    std::list<Entry> _lru;  // most recently used first
+    std::unordered_map<std::string,std::list<Entry>::iterator> _index;
+    unsigned long _capacity;
+    QueryCacheStats _stats;
+    mutable std::mutex _lock;
+
+    void evict();
+};
+
+}
+
+#endif
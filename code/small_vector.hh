@@ -0,0 +1,117 @@
+#ifndef _BN_SMALL_VECTOR_H_
+#define _BN_SMALL_VECTOR_H_
+
+#include <algorithm>
+#include <type_traits>
+
+namespace bn {
+
+// Vector of trivially copyable elements that keeps up to N elements inline
+// and only allocates on the heap beyond that.
+template <typename T, unsigned N>
+class SmallVector {
+    static_assert(std::is_trivially_copyable<T>::value, "SmallVector requires trivially copyable elements");
+
+public:
+    SmallVector() : _data(_inline), _size(0), _capacity(N) {}
+
+    SmallVector(const SmallVector &v) : SmallVector()
+    {
+        reserve(v._size);
+        std::copy(v._data, v._data + v._size, _data);
+        _size = v._size;
+    }
+
+    SmallVector(SmallVector &&v) : SmallVector()
+    {
+        steal(v);
+    }
+
+    ~SmallVector()
+    {
+        if (_data != _inline) delete[] _data;
+    }
+
+    SmallVector &operator=(const SmallVector &v)
+    {
+        if (this != &v) {
+            _size = 0;
+            reserve(v._size);
+            std::copy(v._data, v._data + v._size, _data);
+            _size = v._size;
+        }
+        return *this;
+    }
+
+    SmallVector &operator=(SmallVector &&v)
+    {
+        if (this != &v) {
+            if (_data != _inline) delete[] _data;
+            _data = _inline;
+            _size = 0;
+            _capacity = N;
+            steal(v);
+        }
+        return *this;
+    }
+
+    unsigned size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    T &operator[](unsigned i) { return _data[i]; }
+    const T &operator[](unsigned i) const { return _data[i]; }
+
+    T *begin() { return _data; }
+    T *end()   { return _data + _size; }
+    const T *begin() const { return _data; }
+    const T *end()   const { return _data + _size; }
+
+    void clear() { _size = 0; }
+
+    void reserve(unsigned n)
+    {
+        if (n <= _capacity) return;
+        T *data = new T[n];
+        std::copy(_data, _data + _size, data);
+        if (_data != _inline) delete[] _data;
+        _data = data;
+        _capacity = n;
+    }
+
+    void resize(unsigned n)
+    {
+        reserve(n);
+        _size = n;
+    }
+
+    void push_back(const T &x)
+    {
+        if (_size == _capacity) reserve(2 * _capacity);
+        _data[_size++] = x;
+    }
+
+private:
+    T *_data;
+    unsigned _size;
+    unsigned _capacity;
+    T _inline[N];
+
+    void steal(SmallVector &v)
+    {
+        if (v._data != v._inline) {
+            _data = v._data;
+            _capacity = v._capacity;
+            v._data = v._inline;
+            v._capacity = N;
+        }
+        else {
+            std::copy(v._data, v._data + v._size, _data);
+        }
+        _size = v._size;
+        v._size = 0;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,196 @@
+#include "thread_pool.hh"
+
+using namespace std;
+
+namespace bn {
+
+// pool and deque of the worker running on this thread, if any
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local unsigned current_queue = 0;
+
+static mutex shared_lock;
+static unique_ptr<ThreadPool> shared_pool;
+
+ThreadPool::ThreadPool(unsigned n) : _queued(0), _stop(false)
+{
+    for (unsigned k = 0; k < n; ++k) {
+        _queues.emplace_back(new Queue());
+    }
+    for (unsigned k = 1; k < n; ++k) {
+        _workers.emplace_back(&ThreadPool::work, this, k);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> guard(_lock);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (auto &t : _workers) {
+        t.join();
+    }
+}
+
+ThreadPool&
+ThreadPool::instance()
+{
+    lock_guard<mutex> guard(shared_lock);
+    if (!shared_pool) {
+        shared_pool.reset(new ThreadPool(1));
+    }
+    return *shared_pool;
+}
+
+void
+ThreadPool::set_threads(unsigned n)
+{
+    if (n == 0) {
+        n = thread::hardware_concurrency();
+        if (n == 0) n = 1;
+    }
+
+    lock_guard<mutex> guard(shared_lock);
+    if (shared_pool && shared_pool->threads() == n) return;
+    shared_pool.reset(new ThreadPool(n));
+}
+
+void
+ThreadPool::submit(function<void()> task)
+{
+    if (_workers.empty()) {
+        task();
+        return;
+    }
+
+    unsigned k = (current_pool == this) ? current_queue : 0;
+    {
+        lock_guard<mutex> guard(_queues[k]->lock);
+        _queues[k]->tasks.push_back(move(task));
+    }
+    _queued++;
+
+    // taking the lock orders the push before a worker going to sleep
+    { lock_guard<mutex> guard(_lock); }
+    _wake.notify_one();
+}
+
+bool
+ThreadPool::run_one()
+{
+    unsigned k = (current_pool == this) ? current_queue : 0;
+    function<void()> task;
+    if (pop(k, task) || steal(k, task)) {
+        task();
+        return true;
+    }
+    return false;
+}
+
+void
+ThreadPool::work(unsigned k)
+{
+    current_pool = this;
+    current_queue = k;
+
+    function<void()> task;
+    while (true) {
+        if (pop(k, task) || steal(k, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        unique_lock<mutex> guard(_lock);
+        _wake.wait(guard, [this]() { return _stop || _queued > 0; });
+        if (_stop) return;
+    }
+}
+
+bool
+ThreadPool::pop(unsigned k, function<void()> &task)
+{
+    Queue &q = *_queues[k];
+    lock_guard<mutex> guard(q.lock);
+    if (q.tasks.empty()) return false;
+
+    task = move(q.tasks.back());
+    q.tasks.pop_back();
+    _queued--;
+    return true;
+}
+
+bool
+ThreadPool::steal(unsigned k, function<void()> &task)
+{
+    unsigned n = _queues.size();
+    for (unsigned i = 1; i < n; ++i) {
+        Queue &q = *_queues[(k + i) % n];
+        lock_guard<mutex> guard(q.lock);
+        if (q.tasks.empty()) continue;
+
+        task = move(q.tasks.front());
+        q.tasks.pop_front();
+        _queued--;
+        return true;
+    }
+    return false;
+}
+
+
+TaskGroup::TaskGroup(ThreadPool &pool) : _pool(pool), _pending(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    try {
+        wait();
+    }
+    catch (...) {
+    }
+}
+
+void
+TaskGroup::run(function<void()> task)
+{
+    _pending++;
+    _pool.submit([this, task]() {
+        execute(task);
+        _pending--;
+    });
+}
+
+void
+TaskGroup::wait()
+{
+    while (_pending > 0) {
+        if (!_pool.run_one()) {
+            this_thread::yield();
+        }
+    }
+
+    lock_guard<mutex> guard(_lock);
+    if (_error) {
+        exception_ptr error = _error;
+        _error = nullptr;
+        rethrow_exception(error);
+    }
+}
+
+void
+TaskGroup::execute(const function<void()> &task)
+{
+    try {
+        task();
+    }
+    catch (...) {
+        lock_guard<mutex> guard(_lock);
+        if (!_error) {
+            _error = current_exception();
+        }
+    }
+}
+
+}
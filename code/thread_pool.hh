@@ -0,0 +1,81 @@
+#ifndef _BN_THREAD_POOL_H_
+#define _BN_THREAD_POOL_H_
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+namespace bn {
+
+// Work-stealing pool shared by the inference engines. Every worker owns a
+// deque: it pushes and pops its own tasks at the back and, when it runs
+// dry, steals from the front of the other deques. Threads that are not
+// workers submit to a shared deque. With a single thread there are no
+// workers and tasks run inline on the caller.
+class ThreadPool {
+public:
+    ThreadPool(const ThreadPool &p) = delete;
+    ~ThreadPool();
+
+    static ThreadPool &instance();
+
+    // resize the shared pool, including the calling thread; 0 uses all cores
+    static void set_threads(unsigned n);
+
+    unsigned threads() const { return _workers.size() + 1; }
+
+    void submit(std::function<void()> task);
+
+    // run one pending task on the calling thread, false if there was none
+    bool run_one();
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    ThreadPool(unsigned n);
+
+    std::vector<std::unique_ptr<Queue>> _queues;  // _queues[0] is shared by non-worker threads
+    std::vector<std::thread> _workers;
+    std::atomic<unsigned> _queued;
+    std::atomic<bool> _stop;
+    std::mutex _lock;
+    std::condition_variable _wake;
+
+    void work(unsigned k);
+    bool pop(unsigned k, std::function<void()> &task);
+    bool steal(unsigned k, std::function<void()> &task);
+};
+
+// Set of tasks that can be waited for. The waiting thread runs pending
+// tasks of the pool instead of blocking, so groups can be nested inside
+// tasks. The first exception thrown by a task is rethrown by wait().
+class TaskGroup {
+public:
+    TaskGroup(ThreadPool &pool = ThreadPool::instance());
+    TaskGroup(const TaskGroup &g) = delete;
+    ~TaskGroup();
+
+    void run(std::function<void()> task);
+    void wait();
+
+private:
+    ThreadPool &_pool;
+    std::atomic<unsigned> _pending;
+    std::mutex _lock;
+    std::exception_ptr _error;
+
+    void execute(const std::function<void()> &task);
+};
+
+}
+
+#endif
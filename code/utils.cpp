@@ -26,4 +26,25 @@ parse_vars_set(const Model *model, const std::string s, std::unordered_set<const
 	return 0;
 }
 
+int
+parse_evidence(const Model *model, const std::string s, std::unordered_map<unsigned,unsigned> &evidence)
+{
+	regex evidence_regex("[0-9]+=[0-9]+(,[0-9]+=[0-9]+)*");
+	if (!regex_match(s, evidence_regex)) {
+		return -1;
+	}
+
+	regex assignment_regex("([0-9]+)=([0-9]+)");
+	for (sregex_iterator it(s.begin(), s.end(), assignment_regex); it != sregex_iterator(); ++it) {
+		unsigned id = stoi((*it)[1]);
+		unsigned value = stoi((*it)[2]);
+		if (id >= model->variables().size() || value >= model->variables()[id]->size()) {
+			return -1;
+		}
+		evidence[id] = value;
+	}
+
+	return 0;
+}
+
 }
\ No newline at end of file
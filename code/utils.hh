@@ -5,12 +5,16 @@
 
 #include <string>
 #include <unordered_set>
+#include <unordered_map>
 
 namespace bn {
 
 int
 parse_vars_set(const Model *model, const std::string, std::unordered_set<const Variable*> &vars_set);
 
+int
+parse_evidence(const Model *model, const std::string, std::unordered_map<unsigned,unsigned> &evidence);
+
 }
 
 #endif
\ No newline at end of file